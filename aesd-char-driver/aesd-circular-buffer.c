@@ -30,18 +30,9 @@ struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct
             size_t char_offset, size_t *entry_offset_byte_rtn )
 {
     size_t idx;
-    size_t count = 0;
+    size_t count = aesd_circular_buffer_count(buffer);
     size_t total = 0;
     size_t entries = AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
-    bool is_full = buffer->full;
-
-    if (is_full) {
-        count = entries;
-    } else if (buffer->in_offs >= buffer->out_offs) {
-        count = buffer->in_offs - buffer->out_offs;
-    } else {
-        count = entries + buffer->in_offs - buffer->out_offs;
-    }
 
     idx = buffer->out_offs;
     for (size_t i = 0; i < count; i++) {
@@ -89,3 +80,81 @@ void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer)
 {
     memset(buffer,0,sizeof(struct aesd_circular_buffer));
 }
+
+/**
+* @return the number of entries holding data in @param buffer
+*/
+uint8_t aesd_circular_buffer_count(const struct aesd_circular_buffer *buffer)
+{
+    if (buffer->full) {
+        return AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+    }
+    return (buffer->in_offs + AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED - buffer->out_offs)
+            % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+}
+
+/**
+* @return the entry @param n places after the oldest entry in @param buffer, so n=0 returns the
+* oldest entry, or NULL if the buffer holds n or fewer entries.
+* Any necessary locking must be performed by caller.
+*/
+struct aesd_buffer_entry *aesd_circular_buffer_entry_at(struct aesd_circular_buffer *buffer, uint8_t n)
+{
+    if (n >= aesd_circular_buffer_count(buffer)) {
+        return NULL;
+    }
+    return &buffer->entry[(buffer->out_offs + n) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+}
+
+/**
+* Describe the bytes [@param char_offset, @param char_offset + @param len) of @param buffer, using the
+* same offsets as aesd_circular_buffer_find_entry_offset_for_fpos, as an array of iovec (kvec in the
+* kernel) members pointing at the entry contents in logical order.  The result can be passed directly
+* to writev() or used to fill an iov_iter without walking the buffer again.
+* Any necessary locking must be performed by caller, and the entries must not be modified while
+* @param vec is in use.
+* @param vec the array to fill
+* @param max_vecs the number of members available in @param vec.  AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED
+*      members are always enough to describe the whole buffer.
+* @param vec_count_rtn is set to the number of members of @param vec which were filled
+* @return the number of bytes described by @param vec, which is less than @param len when the buffer
+* ends first or @param max_vecs members were not enough.
+*/
+size_t aesd_circular_buffer_export_range(struct aesd_circular_buffer *buffer, size_t char_offset,
+            size_t len, struct aesd_iovec *vec, size_t max_vecs, size_t *vec_count_rtn)
+{
+    size_t entry_offset = 0;
+    size_t exported = 0;
+    size_t nvec = 0;
+    uint8_t index;
+    struct aesd_buffer_entry *entry;
+
+    AESD_CIRCULAR_BUFFER_FOREACH_LOGICAL(entry, buffer, index) {
+        size_t skip = 0;
+        size_t chunk;
+
+        if (exported == len || nvec == max_vecs) {
+            break;
+        }
+        if (char_offset >= entry_offset + entry->size) {
+            entry_offset += entry->size;
+            continue;
+        }
+
+        if (char_offset > entry_offset) {
+            skip = char_offset - entry_offset;
+        }
+        chunk = entry->size - skip;
+        if (chunk > len - exported) {
+            chunk = len - exported;
+        }
+        vec[nvec].iov_base = (void *)(entry->buffptr + skip);
+        vec[nvec].iov_len = chunk;
+        nvec++;
+        exported += chunk;
+        entry_offset += entry->size;
+    }
+
+    *vec_count_rtn = nvec;
+    return exported;
+}
@@ -10,13 +10,21 @@
 
 #ifdef __KERNEL__
 #include <linux/types.h>
+#include <linux/uio.h>
+/* struct kvec and struct iovec share iov_base and iov_len members */
+#define aesd_iovec kvec
 #else
 #include <stddef.h> // size_t
 #include <stdint.h> // uintx_t
 #include <stdbool.h>
+#include <sys/uio.h> // struct iovec
+#define aesd_iovec iovec
 #endif
 
+#ifndef AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED
+/* May be overridden up to 255 (the range of in_offs/out_offs), as the benchmarks do */
 #define AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED 10
+#endif
 
 struct aesd_buffer_entry
 {
@@ -58,6 +66,13 @@ extern const char *aesd_circular_buffer_add_entry(struct aesd_circular_buffer *b
 
 extern void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer);
 
+extern uint8_t aesd_circular_buffer_count(const struct aesd_circular_buffer *buffer);
+
+extern struct aesd_buffer_entry *aesd_circular_buffer_entry_at(struct aesd_circular_buffer *buffer, uint8_t n);
+
+extern size_t aesd_circular_buffer_export_range(struct aesd_circular_buffer *buffer, size_t char_offset,
+            size_t len, struct aesd_iovec *vec, size_t max_vecs, size_t *vec_count_rtn);
+
 /**
  * Create a for loop to iterate over each member of the circular buffer.
  * Useful when you've allocated memory for circular buffer entries and need to free it
@@ -77,6 +92,26 @@ extern void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer);
             index<AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; \
             index++, entryptr=&((buffer)->entry[index]))
 
+/**
+ * Create a for loop to iterate over the entries which hold data, oldest first.  This is the order
+ * in which their contents are seen through aesd_circular_buffer_find_entry_offset_for_fpos.
+ * @param entryptr is a struct aesd_buffer_entry* to set with the current entry
+ * @param buffer is the struct aesd_buffer * describing the buffer
+ * @param index is a uint8_t stack allocated value set to the zero referenced logical index of entryptr
+ * Example usage:
+ * uint8_t index;
+ * struct aesd_circular_buffer buffer;
+ * struct aesd_buffer_entry *entry;
+ * size_t total = 0;
+ * AESD_CIRCULAR_BUFFER_FOREACH_LOGICAL(entry,&buffer,index) {
+ *      total += entry->size;
+ * }
+ */
+#define AESD_CIRCULAR_BUFFER_FOREACH_LOGICAL(entryptr,buffer,index) \
+    for(index=0, entryptr=aesd_circular_buffer_entry_at(buffer,index); \
+            entryptr != NULL; \
+            index++, entryptr=aesd_circular_buffer_entry_at(buffer,index))
+
 
 
 #endif /* AESD_CIRCULAR_BUFFER_H */
@@ -0,0 +1,213 @@
+/**
+ * @file aesd-ring.c
+ * @brief Lock-free single and multi producer rings of aesd_buffer_entry, see aesd-ring.h
+ *
+ * The multi producer ring uses a sequence number per slot, so producers only contend on the
+ * tail index when claiming positions and never on the slots themselves.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "aesd-ring.h"
+
+/**
+ * @return @param capacity rounded up to a power of two, or 0 on overflow
+ */
+static size_t ring_capacity(size_t capacity)
+{
+    size_t rounded = 2;
+
+    while (rounded < capacity) {
+        if (rounded > ((size_t)-1) / 2) {
+            return 0;
+        }
+        rounded <<= 1;
+    }
+    return rounded;
+}
+
+/**
+* Initializes @param ring to hold at least @param capacity entries, rounded up to a power of two
+* @return true on success, false if memory could not be allocated
+*/
+bool aesd_spsc_ring_init(struct aesd_spsc_ring *ring, size_t capacity)
+{
+    size_t rounded = ring_capacity(capacity);
+
+    memset(ring, 0, sizeof(*ring));
+    if (rounded == 0) {
+        return false;
+    }
+    ring->entry = calloc(rounded, sizeof(struct aesd_buffer_entry));
+    if (!ring->entry) {
+        return false;
+    }
+    ring->mask = rounded - 1;
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    return true;
+}
+
+/**
+* Frees memory allocated by aesd_spsc_ring_init().  Memory referenced by entries still in the ring
+* is owned by the caller and is not freed.
+*/
+void aesd_spsc_ring_destroy(struct aesd_spsc_ring *ring)
+{
+    free(ring->entry);
+    ring->entry = NULL;
+}
+
+/**
+* Push up to @param count entries from @param entries, in order.  Only one thread may push.
+* @return the number of entries pushed, less than @param count if the ring filled up
+*/
+size_t aesd_spsc_ring_push_batch(struct aesd_spsc_ring *ring, const struct aesd_buffer_entry *entries, size_t count)
+{
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    size_t capacity = ring->mask + 1;
+    size_t space = capacity - (tail - ring->head_cache);
+    size_t i;
+
+    if (space < count) {
+        ring->head_cache = atomic_load_explicit(&ring->head, memory_order_acquire);
+        space = capacity - (tail - ring->head_cache);
+    }
+    if (count > space) {
+        count = space;
+    }
+
+    for (i = 0; i < count; i++) {
+        ring->entry[(tail + i) & ring->mask] = entries[i];
+    }
+    atomic_store_explicit(&ring->tail, tail + count, memory_order_release);
+    return count;
+}
+
+/**
+* Pop up to @param max of the oldest entries into @param entries.  Only one thread may pop.
+* @return the number of entries popped, 0 if the ring was empty
+*/
+size_t aesd_spsc_ring_pop_batch(struct aesd_spsc_ring *ring, struct aesd_buffer_entry *entries, size_t max)
+{
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    size_t avail = ring->tail_cache - head;
+    size_t i;
+
+    if (avail < max) {
+        ring->tail_cache = atomic_load_explicit(&ring->tail, memory_order_acquire);
+        avail = ring->tail_cache - head;
+    }
+    if (max > avail) {
+        max = avail;
+    }
+
+    for (i = 0; i < max; i++) {
+        entries[i] = ring->entry[(head + i) & ring->mask];
+    }
+    atomic_store_explicit(&ring->head, head + max, memory_order_release);
+    return max;
+}
+
+/**
+* Initializes @param ring to hold at least @param capacity entries, rounded up to a power of two
+* @return true on success, false if memory could not be allocated
+*/
+bool aesd_mpsc_ring_init(struct aesd_mpsc_ring *ring, size_t capacity)
+{
+    size_t rounded = ring_capacity(capacity);
+    size_t i;
+
+    memset(ring, 0, sizeof(*ring));
+    if (rounded == 0) {
+        return false;
+    }
+    ring->slot = calloc(rounded, sizeof(struct aesd_mpsc_slot));
+    if (!ring->slot) {
+        return false;
+    }
+    for (i = 0; i < rounded; i++) {
+        atomic_init(&ring->slot[i].seq, i);
+    }
+    ring->mask = rounded - 1;
+    atomic_init(&ring->tail, 0);
+    return true;
+}
+
+/**
+* Frees memory allocated by aesd_mpsc_ring_init().  Memory referenced by entries still in the ring
+* is owned by the caller and is not freed.
+*/
+void aesd_mpsc_ring_destroy(struct aesd_mpsc_ring *ring)
+{
+    free(ring->slot);
+    ring->slot = NULL;
+}
+
+/**
+* Push up to @param count entries from @param entries.  Any number of threads may push concurrently,
+* the entries of one batch are claimed with a single atomic operation and are seen by the consumer
+* in order, with no entries from other producers in between.
+* @return the number of entries pushed, less than @param count if the ring filled up
+*/
+size_t aesd_mpsc_ring_push_batch(struct aesd_mpsc_ring *ring, const struct aesd_buffer_entry *entries, size_t count)
+{
+    size_t pos = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    size_t n;
+    size_t i;
+
+    for (;;) {
+        for (n = 0; n < count; n++) {
+            struct aesd_mpsc_slot *slot = &ring->slot[(pos + n) & ring->mask];
+            if (atomic_load_explicit(&slot->seq, memory_order_acquire) != pos + n) {
+                break;
+            }
+        }
+
+        if (n == 0) {
+            size_t seq = atomic_load_explicit(&ring->slot[pos & ring->mask].seq, memory_order_acquire);
+            if ((ptrdiff_t)(seq - pos) < 0) {
+                /* The slot still holds an entry from the previous lap, the ring is full */
+                return 0;
+            }
+            /* Another producer claimed pos first */
+            pos = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+            continue;
+        }
+
+        if (atomic_compare_exchange_weak_explicit(&ring->tail, &pos, pos + n,
+                    memory_order_relaxed, memory_order_relaxed)) {
+            break;
+        }
+    }
+
+    for (i = 0; i < n; i++) {
+        struct aesd_mpsc_slot *slot = &ring->slot[(pos + i) & ring->mask];
+        slot->entry = entries[i];
+        atomic_store_explicit(&slot->seq, pos + i + 1, memory_order_release);
+    }
+    return n;
+}
+
+/**
+* Pop up to @param max of the oldest published entries into @param entries.  Only one thread may pop.
+* @return the number of entries popped, 0 if no entry was ready
+*/
+size_t aesd_mpsc_ring_pop_batch(struct aesd_mpsc_ring *ring, struct aesd_buffer_entry *entries, size_t max)
+{
+    size_t head = ring->head;
+    size_t n;
+
+    for (n = 0; n < max; n++) {
+        struct aesd_mpsc_slot *slot = &ring->slot[(head + n) & ring->mask];
+        if (atomic_load_explicit(&slot->seq, memory_order_acquire) != head + n + 1) {
+            break;
+        }
+        entries[n] = slot->entry;
+        atomic_store_explicit(&slot->seq, head + n + ring->mask + 1, memory_order_release);
+    }
+    ring->head = head + n;
+    return n;
+}
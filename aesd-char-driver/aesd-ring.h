@@ -0,0 +1,117 @@
+/*
+ * aesd-ring.h
+ *
+ *  @brief Lock-free rings of struct aesd_buffer_entry for handing commands between userspace threads
+ *
+ *  struct aesd_circular_buffer requires the caller to provide locking.  These rings carry the same
+ *  entries (a buffptr and size, with memory owned by the caller) between threads without a mutex:
+ *  aesd_spsc_ring for one producer and one consumer, aesd_mpsc_ring for any number of producers
+ *  and one consumer.  Unlike aesd_circular_buffer_add_entry, a push never overwrites the oldest
+ *  entry; it fails when the ring is full so the producer still owns its buffer and can apply
+ *  backpressure.
+ */
+
+#ifndef AESD_RING_H
+#define AESD_RING_H
+
+#ifdef __KERNEL__
+#error "aesd-ring.h is only available in userspace, use struct aesd_circular_buffer with a lock in the kernel"
+#endif
+
+#include <stdatomic.h>
+#include "aesd-circular-buffer.h"
+
+/**
+ * Indices written by different threads are kept on separate cache lines of this size
+ */
+#define AESD_RING_CACHELINE 64
+
+struct aesd_spsc_ring
+{
+    /**
+     * The next position to pop, written only by the consumer
+     */
+    _Alignas(AESD_RING_CACHELINE) atomic_size_t head;
+    /**
+     * The consumer's last observed value of tail
+     */
+    size_t tail_cache;
+    /**
+     * The next position to push, written only by the producer
+     */
+    _Alignas(AESD_RING_CACHELINE) atomic_size_t tail;
+    /**
+     * The producer's last observed value of head
+     */
+    size_t head_cache;
+    /**
+     * Capacity - 1, the capacity is a power of two
+     */
+    _Alignas(AESD_RING_CACHELINE) size_t mask;
+    struct aesd_buffer_entry *entry;
+};
+
+struct aesd_mpsc_slot
+{
+    /**
+     * Equal to the position when the slot is free for a producer at that position, and to the
+     * position + 1 once the entry is published to the consumer
+     */
+    atomic_size_t seq;
+    struct aesd_buffer_entry entry;
+};
+
+struct aesd_mpsc_ring
+{
+    /**
+     * The next position to be claimed by a producer
+     */
+    _Alignas(AESD_RING_CACHELINE) atomic_size_t tail;
+    /**
+     * The next position to pop, used only by the consumer
+     */
+    _Alignas(AESD_RING_CACHELINE) size_t head;
+    /**
+     * Capacity - 1, the capacity is a power of two
+     */
+    _Alignas(AESD_RING_CACHELINE) size_t mask;
+    struct aesd_mpsc_slot *slot;
+};
+
+extern bool aesd_spsc_ring_init(struct aesd_spsc_ring *ring, size_t capacity);
+extern void aesd_spsc_ring_destroy(struct aesd_spsc_ring *ring);
+extern size_t aesd_spsc_ring_push_batch(struct aesd_spsc_ring *ring, const struct aesd_buffer_entry *entries, size_t count);
+extern size_t aesd_spsc_ring_pop_batch(struct aesd_spsc_ring *ring, struct aesd_buffer_entry *entries, size_t max);
+
+extern bool aesd_mpsc_ring_init(struct aesd_mpsc_ring *ring, size_t capacity);
+extern void aesd_mpsc_ring_destroy(struct aesd_mpsc_ring *ring);
+extern size_t aesd_mpsc_ring_push_batch(struct aesd_mpsc_ring *ring, const struct aesd_buffer_entry *entries, size_t count);
+extern size_t aesd_mpsc_ring_pop_batch(struct aesd_mpsc_ring *ring, struct aesd_buffer_entry *entries, size_t max);
+
+/**
+ * @return true if @param entry was pushed, false if the ring was full
+ */
+static inline bool aesd_spsc_ring_push(struct aesd_spsc_ring *ring, const struct aesd_buffer_entry *entry)
+{
+    return aesd_spsc_ring_push_batch(ring, entry, 1) == 1;
+}
+
+/**
+ * @return true if @param entry was filled with the oldest entry, false if the ring was empty
+ */
+static inline bool aesd_spsc_ring_pop(struct aesd_spsc_ring *ring, struct aesd_buffer_entry *entry)
+{
+    return aesd_spsc_ring_pop_batch(ring, entry, 1) == 1;
+}
+
+static inline bool aesd_mpsc_ring_push(struct aesd_mpsc_ring *ring, const struct aesd_buffer_entry *entry)
+{
+    return aesd_mpsc_ring_push_batch(ring, entry, 1) == 1;
+}
+
+static inline bool aesd_mpsc_ring_pop(struct aesd_mpsc_ring *ring, struct aesd_buffer_entry *entry)
+{
+    return aesd_mpsc_ring_pop_batch(ring, entry, 1) == 1;
+}
+
+#endif /* AESD_RING_H */
@@ -18,6 +18,8 @@
 #include <stdint.h>
 #endif
 
+#include "aesd-circular-buffer.h" // AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED
+
 /**
  * A structure to be passed by IOCTL from user space to kernel space, describing the type
  * of seek performed on the aesdchar driver
@@ -33,14 +35,70 @@ struct aesd_seekto {
     uint32_t write_cmd_offset;
 };
 
+/**
+ * Passed with AESDCHAR_IOCREADAT to seek and read in a single call
+ */
+struct aesd_read_at {
+    /**
+     * The command and offset to start reading from, as used with AESDCHAR_IOCSEEKTO
+     */
+    struct aesd_seekto seekto;
+    /**
+     * User space address of the buffer to fill, cast to uint64_t
+     */
+    uint64_t buf;
+    /**
+     * The number of bytes available at buf
+     */
+    uint64_t len;
+    /**
+     * Set by the driver to the number of bytes copied to buf
+     */
+    uint64_t bytes_read;
+};
+
+struct aesd_entry_info {
+    /**
+     * Zero referenced number of this command among all commands written to the device
+     */
+    uint64_t seq;
+    /**
+     * The number of bytes in the command, including the terminating newline
+     */
+    uint64_t size;
+};
+
+/**
+ * Filled by AESDCHAR_IOCGETTABLE with the commands currently held by the device
+ */
+struct aesd_entry_table {
+    /**
+     * The number of valid members of entry[]
+     */
+    uint32_t count;
+    uint32_t reserved;
+    /**
+     * Sum of the size of all entries, which is also the size of the device seen through read()
+     */
+    uint64_t total_bytes;
+    /**
+     * The stored commands, oldest first.  entry[n] is the write_cmd value n used with AESDCHAR_IOCSEEKTO
+     */
+    struct aesd_entry_info entry[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+};
+
 // Pick an arbitrary unused value from https://github.com/torvalds/linux/blob/master/Documentation/userspace-api/ioctl/ioctl-number.rst
 #define AESD_IOC_MAGIC 0x16
 
 // Define a write command from the user point of view, use command number 1
 #define AESDCHAR_IOCSEEKTO _IOWR(AESD_IOC_MAGIC, 1, struct aesd_seekto)
+// Seek to a command and copy data from it, see struct aesd_read_at
+#define AESDCHAR_IOCREADAT _IOWR(AESD_IOC_MAGIC, 2, struct aesd_read_at)
+// Obtain the size and sequence number of every stored command
+#define AESDCHAR_IOCGETTABLE _IOR(AESD_IOC_MAGIC, 3, struct aesd_entry_table)
 /**
  * The maximum number of commands supported, used for bounds checking
  */
-#define AESDCHAR_IOC_MAXNR 1
+#define AESDCHAR_IOC_MAXNR 3
 
 #endif /* AESD_IOCTL_H */
@@ -0,0 +1,112 @@
+/*
+ * aesd_mmap.h
+ *
+ *  @brief Layout of the read-only mapping exported by aesd char devices through mmap()
+ *
+ *  The mapping starts with a header page holding the entry table, followed by a data
+ *  region containing a copy of each committed write command.  Readers map
+ *  AESD_MMAP_SIZE bytes with PROT_READ and MAP_SHARED and use the seq member to detect
+ *  concurrent updates, in the same way as a kernel seqcount:
+ *
+ *  do {
+ *      seq = aesd_mmap_read_begin(hdr);
+ *      ... copy what you need out of hdr and the data region ...
+ *  } while (aesd_mmap_read_retry(hdr, seq));
+ */
+
+#ifndef AESD_MMAP_H
+#define AESD_MMAP_H
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#else
+#include <stdint.h>
+#endif
+
+#include "aesd-circular-buffer.h"
+
+#define AESD_MMAP_MAGIC          0x44534541 /* "AESD" little endian */
+#define AESD_MMAP_VERSION        1
+
+/**
+ * Size of the header at the start of the mapping, the data region starts at this offset
+ */
+#define AESD_MMAP_HEADER_SIZE    4096
+/**
+ * Size of the data region used to hold copies of the committed write commands
+ */
+#define AESD_MMAP_DATA_SIZE      (64 * 1024)
+/**
+ * Total number of bytes to pass to mmap()
+ */
+#define AESD_MMAP_SIZE           (AESD_MMAP_HEADER_SIZE + AESD_MMAP_DATA_SIZE)
+
+/**
+ * Value of aesd_mmap_entry.offset for a command which is too large for the data region.
+ * Use read() to obtain the content of these commands.
+ */
+#define AESD_MMAP_ENTRY_UNMAPPED 0xffffffffu
+
+struct aesd_mmap_entry {
+    /**
+     * Byte offset of the command from the start of the data region, or AESD_MMAP_ENTRY_UNMAPPED
+     */
+    uint32_t offset;
+    /**
+     * Number of bytes in the command
+     */
+    uint32_t size;
+};
+
+struct aesd_mmap_header {
+    uint32_t magic;
+    uint32_t version;
+    /**
+     * Incremented before and after each update, odd while an update is in progress
+     */
+    uint32_t seq;
+    /**
+     * The number of valid members of entry[]
+     */
+    uint32_t count;
+    /**
+     * Byte offset of the data region from the start of the mapping
+     */
+    uint32_t data_offset;
+    /**
+     * Number of bytes in the data region
+     */
+    uint32_t data_size;
+    /**
+     * Sum of the size of all entries, matching the size seen through read()
+     */
+    uint64_t total_bytes;
+    /**
+     * The stored write commands, oldest first
+     */
+    struct aesd_mmap_entry entry[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+};
+
+#ifndef __KERNEL__
+/**
+ * @return the sequence value to pass to aesd_mmap_read_retry() once the caller is done reading
+ */
+static inline uint32_t aesd_mmap_read_begin(const struct aesd_mmap_header *hdr)
+{
+    uint32_t seq;
+    while ((seq = __atomic_load_n(&hdr->seq, __ATOMIC_ACQUIRE)) & 1)
+        ;
+    return seq;
+}
+
+/**
+ * @return non zero if the header or data region changed since @param seq was obtained
+ */
+static inline int aesd_mmap_read_retry(const struct aesd_mmap_header *hdr, uint32_t seq)
+{
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&hdr->seq, __ATOMIC_RELAXED) != seq;
+}
+#endif
+
+#endif /* AESD_MMAP_H */
@@ -9,8 +9,9 @@
 #define AESD_CHAR_DRIVER_AESDCHAR_H_
 
 #include "aesd-circular-buffer.h"
+#include "aesd_mmap.h"
 
-#define AESD_DEBUG 1  //Remove comment on this line to enable debug
+//#define AESD_DEBUG 1  //Remove comment on this line to enable debug, or build with DEBUG=y
 
 #undef PDEBUG             /* undef it, just in case */
 #ifdef AESD_DEBUG
@@ -25,12 +26,61 @@
 #  define PDEBUG(fmt, args...) /* not debugging: nothing */
 #endif
 
+#ifndef AESD_NR_DEVS
+#define AESD_NR_DEVS 1    /* default number of devices, see the aesd_nr_devs module parameter */
+#endif
+
+/**
+ * Number of log2 buckets in the latency histograms, bucket i counts calls taking
+ * less than 2^i ns, the last bucket counts everything slower
+ */
+#define AESD_LATENCY_BUCKETS 32
+
+/**
+ * Per device counters exported through debugfs.  Members other than the latency
+ * histograms are protected by aesd_dev.lock.
+ */
+struct aesd_stats {
+    u64                           reads;
+    u64                           writes;
+    u64                           bytes_written;
+    u64                           evictions;
+    /**
+     * Number of times the device lock was already held when requested, and the total
+     * time spent waiting for it
+     */
+    u64                           lock_contended;
+    u64                           lock_wait_ns;
+    atomic64_t                    read_latency[AESD_LATENCY_BUCKETS];
+    atomic64_t                    write_latency[AESD_LATENCY_BUCKETS];
+};
 
 struct aesd_dev {
     struct cdev                   cdev;  
     struct aesd_circular_buffer   buffer;
     struct aesd_buffer_entry      work;  
     struct mutex                  lock;  
+    /**
+     * Readers waiting for a new command, woken each time a write command is committed
+     */
+    wait_queue_head_t             readq;
+    /**
+     * Number of write commands committed since the device was created
+     */
+    u64                           commits;
+    /**
+     * Header page and data region exported read-only through mmap, see aesd_mmap.h
+     */
+    void                         *mmap_area;
+    /**
+     * Location of each buffer.entry[] slot within the mmap data region
+     */
+    struct aesd_mmap_entry        mmap_slot[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+    /**
+     * Offset in the mmap data region where the next command will be copied
+     */
+    uint32_t                      mmap_head;
+    struct aesd_stats             stats;
 };
 
 
@@ -0,0 +1,88 @@
+/*
+ * aesdchar_trace.h
+ *
+ *  @brief Tracepoints for the aesd char driver, available under events/aesdchar in tracefs
+ *  for use with ftrace and perf
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM aesdchar
+
+#if !defined(_AESDCHAR_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _AESDCHAR_TRACE_H
+
+#include <linux/tracepoint.h>
+
+DECLARE_EVENT_CLASS(aesd_rw,
+    TP_PROTO(unsigned int minor, loff_t pos, size_t count, ssize_t ret),
+    TP_ARGS(minor, pos, count, ret),
+    TP_STRUCT__entry(
+        __field(unsigned int, minor)
+        __field(loff_t, pos)
+        __field(size_t, count)
+        __field(ssize_t, ret)
+    ),
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->pos = pos;
+        __entry->count = count;
+        __entry->ret = ret;
+    ),
+    TP_printk("minor=%u pos=%lld count=%zu ret=%zd",
+              __entry->minor, __entry->pos, __entry->count, __entry->ret)
+);
+
+DEFINE_EVENT(aesd_rw, aesd_read,
+    TP_PROTO(unsigned int minor, loff_t pos, size_t count, ssize_t ret),
+    TP_ARGS(minor, pos, count, ret)
+);
+
+DEFINE_EVENT(aesd_rw, aesd_write,
+    TP_PROTO(unsigned int minor, loff_t pos, size_t count, ssize_t ret),
+    TP_ARGS(minor, pos, count, ret)
+);
+
+TRACE_EVENT(aesd_llseek,
+    TP_PROTO(unsigned int minor, loff_t offset, int whence, loff_t ret),
+    TP_ARGS(minor, offset, whence, ret),
+    TP_STRUCT__entry(
+        __field(unsigned int, minor)
+        __field(loff_t, offset)
+        __field(int, whence)
+        __field(loff_t, ret)
+    ),
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->offset = offset;
+        __entry->whence = whence;
+        __entry->ret = ret;
+    ),
+    TP_printk("minor=%u offset=%lld whence=%d ret=%lld",
+              __entry->minor, __entry->offset, __entry->whence, __entry->ret)
+);
+
+TRACE_EVENT(aesd_ioctl,
+    TP_PROTO(unsigned int minor, unsigned int cmd, long ret),
+    TP_ARGS(minor, cmd, ret),
+    TP_STRUCT__entry(
+        __field(unsigned int, minor)
+        __field(unsigned int, cmd)
+        __field(long, ret)
+    ),
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->cmd = cmd;
+        __entry->ret = ret;
+    ),
+    TP_printk("minor=%u cmd=0x%x ret=%ld",
+              __entry->minor, __entry->cmd, __entry->ret)
+);
+
+#endif /* _AESDCHAR_TRACE_H */
+
+/* This part must be outside the include guard */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE aesdchar_trace
+#include <trace/define_trace.h>
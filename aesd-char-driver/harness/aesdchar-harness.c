@@ -0,0 +1,319 @@
+/**
+ * @file aesdchar-harness.c
+ * @brief Multithreaded workload for the aesdchar driver logic, run in userspace through kshim.h
+ *
+ * Writer threads append fixed length commands, reader threads rewind and read the whole device,
+ * and seeker threads issue AESDCHAR_IOCSEEKTO followed by a read of one command, all through the
+ * file_operations of ../main.c.  Threads are spread round robin over the devices.  At the end
+ * the throughput of each kind of operation and the lock contention recorded by each device is
+ * printed, and the content of every device is checked to hold only complete commands.
+ *
+ * Usage: aesdchar-harness [-w writers] [-r readers] [-s seekers] [-n devices] [-t seconds]
+ *                         [-l command length] [-v]
+ *
+ * -v also prints the debugfs stats and latency files of each device.
+ * Run under perf with "perf record -g ./aesdchar-harness", or build with SANITIZE=thread.
+ */
+
+#include <stdatomic.h>
+#include <unistd.h>
+
+#include "kshim.h"
+#include "aesdchar.h"
+#include "aesd_ioctl.h"
+
+#define HARNESS_READ_SIZE   4096
+#define HARNESS_MIN_LENGTH  16
+#define HARNESS_MAX_LENGTH  4096
+
+/* Provided by ../main.c */
+extern int aesd_nr_devs;
+extern struct aesd_dev *aesd_devices;
+extern int aesd_init_module(void);
+extern void aesd_cleanup_module(void);
+extern int aesd_open(struct inode *inode, struct file *filp);
+extern int aesd_release(struct inode *inode, struct file *filp);
+extern ssize_t aesd_read_iter(struct kiocb *iocb, struct iov_iter *to);
+extern ssize_t aesd_write_iter(struct kiocb *iocb, struct iov_iter *from);
+extern loff_t aesd_llseek(struct file *filp, loff_t offset, int whence);
+extern long aesd_ioctl(struct file *filp, unsigned int cmd, unsigned long arg);
+
+enum worker_kind {
+    WORKER_WRITER,
+    WORKER_READER,
+    WORKER_SEEKER,
+    WORKER_KINDS
+};
+
+static const char *const worker_kind_name[WORKER_KINDS] = { "write", "read", "seek+read" };
+
+struct worker {
+    pthread_t thread;
+    enum worker_kind kind;
+    int id;
+    struct inode inode;
+    struct file filp;
+    unsigned int seed;
+    unsigned long long ops;
+    unsigned long long bytes;
+    unsigned long long errors;
+};
+
+static atomic_bool stop;
+static size_t line_length = 64;
+
+static ssize_t harness_read(struct file *filp, char *buf, size_t len)
+{
+    struct iovec iov = { .iov_base = buf, .iov_len = len };
+    struct kiocb iocb = { .ki_filp = filp, .ki_pos = filp->f_pos };
+    struct iov_iter iter;
+    ssize_t retval;
+
+    iov_iter_init(&iter, 0, &iov, 1, len);
+    retval = aesd_read_iter(&iocb, &iter);
+    filp->f_pos = iocb.ki_pos;
+    return retval;
+}
+
+static ssize_t harness_write(struct file *filp, const char *buf, size_t len)
+{
+    struct iovec iov = { .iov_base = (void *)buf, .iov_len = len };
+    struct kiocb iocb = { .ki_filp = filp, .ki_pos = filp->f_pos };
+    struct iov_iter iter;
+
+    iov_iter_init(&iter, 1, &iov, 1, len);
+    return aesd_write_iter(&iocb, &iter);
+}
+
+static void run_writer(struct worker *w)
+{
+    char line[HARNESS_MAX_LENGTH];
+    int prefix;
+
+    while (!atomic_load_explicit(&stop, memory_order_relaxed)) {
+        prefix = snprintf(line, sizeof(line), "w%d %llu ", w->id, w->ops);
+        memset(line + prefix, 'x', line_length - 1 - prefix);
+        line[line_length - 1] = '\n';
+        if (harness_write(&w->filp, line, line_length) == (ssize_t)line_length) {
+            w->bytes += line_length;
+        } else {
+            w->errors++;
+        }
+        w->ops++;
+    }
+}
+
+static void run_reader(struct worker *w)
+{
+    char buf[HARNESS_READ_SIZE];
+    ssize_t len;
+
+    while (!atomic_load_explicit(&stop, memory_order_relaxed)) {
+        if (aesd_llseek(&w->filp, 0, SEEK_SET) != 0) {
+            w->errors++;
+        }
+        while ((len = harness_read(&w->filp, buf, sizeof(buf))) > 0) {
+            w->bytes += len;
+        }
+        if (len < 0) {
+            w->errors++;
+        }
+        w->ops++;
+    }
+}
+
+static void run_seeker(struct worker *w)
+{
+    char buf[HARNESS_MAX_LENGTH];
+    struct aesd_seekto seekto;
+    ssize_t len;
+
+    while (!atomic_load_explicit(&stop, memory_order_relaxed)) {
+        seekto.write_cmd = rand_r(&w->seed) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+        seekto.write_cmd_offset = rand_r(&w->seed) % line_length;
+        if (aesd_ioctl(&w->filp, AESDCHAR_IOCSEEKTO, (unsigned long)&seekto) == 0) {
+            len = harness_read(&w->filp, buf, line_length - seekto.write_cmd_offset);
+            if (len > 0) {
+                w->bytes += len;
+            } else {
+                w->errors++;
+            }
+        } else {
+            /* The device holds fewer commands than write_cmd, before the writers fill it */
+            w->errors++;
+        }
+        w->ops++;
+    }
+}
+
+static void *worker_thread(void *arg)
+{
+    struct worker *w = arg;
+
+    switch (w->kind) {
+    case WORKER_WRITER:
+        run_writer(w);
+        break;
+    case WORKER_READER:
+        run_reader(w);
+        break;
+    default:
+        run_seeker(w);
+        break;
+    }
+    return NULL;
+}
+
+/**
+ * @return true if device @param index holds only complete commands written by run_writer()
+ */
+static bool verify_device(int index)
+{
+    struct inode inode = { .i_cdev = &aesd_devices[index].cdev };
+    struct file filp = { 0 };
+    char buf[HARNESS_READ_SIZE];
+    size_t column = 0;
+    unsigned int commands = 0;
+    bool ok = true;
+    ssize_t len, i;
+
+    aesd_open(&inode, &filp);
+    while (ok && (len = harness_read(&filp, buf, sizeof(buf))) > 0) {
+        for (i = 0; i < len && ok; i++) {
+            if (column == 0 && buf[i] != 'w') {
+                ok = false;
+            }
+            if (buf[i] == '\n') {
+                ok = column + 1 == line_length;
+                column = 0;
+                commands++;
+            } else {
+                column++;
+            }
+        }
+    }
+    aesd_release(&inode, &filp);
+
+    ok = ok && column == 0 && commands <= AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+    if (!ok) {
+        fprintf(stderr, "aesdchar%d: corrupt content after %u commands\n", index, commands);
+    }
+    return ok;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-w writers] [-r readers] [-s seekers] [-n devices] [-t seconds]"
+            " [-l command length] [-v]\n", prog);
+}
+
+int main(int argc, char **argv)
+{
+    int threads[WORKER_KINDS] = { 2, 2, 1 };
+    unsigned long long ops[WORKER_KINDS] = { 0 };
+    unsigned long long bytes[WORKER_KINDS] = { 0 };
+    unsigned long long errors[WORKER_KINDS] = { 0 };
+    unsigned long long *dev_ops;
+    struct worker *workers;
+    int nworkers, seconds = 2;
+    bool verbose = false, ok = true;
+    u64 start, elapsed;
+    int opt, i, k;
+
+    while ((opt = getopt(argc, argv, "w:r:s:n:t:l:v")) != -1) {
+        switch (opt) {
+        case 'w': threads[WORKER_WRITER] = atoi(optarg); break;
+        case 'r': threads[WORKER_READER] = atoi(optarg); break;
+        case 's': threads[WORKER_SEEKER] = atoi(optarg); break;
+        case 'n': aesd_nr_devs = atoi(optarg); break;
+        case 't': seconds = atoi(optarg); break;
+        case 'l': line_length = strtoul(optarg, NULL, 0); break;
+        case 'v': verbose = true; break;
+        default:
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    if (line_length < HARNESS_MIN_LENGTH || line_length > HARNESS_MAX_LENGTH || seconds < 1 ||
+        threads[WORKER_WRITER] < 0 || threads[WORKER_READER] < 0 || threads[WORKER_SEEKER] < 0) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    if (aesd_init_module() != 0) {
+        fprintf(stderr, "aesd_init_module failed\n");
+        return 1;
+    }
+
+    nworkers = threads[WORKER_WRITER] + threads[WORKER_READER] + threads[WORKER_SEEKER];
+    workers = calloc(nworkers ? nworkers : 1, sizeof(*workers));
+    dev_ops = calloc(aesd_nr_devs, sizeof(*dev_ops));
+    if (!workers || !dev_ops) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+
+    start = ktime_get_ns();
+    for (i = 0, k = 0; k < WORKER_KINDS; k++) {
+        int n;
+        for (n = 0; n < threads[k]; n++, i++) {
+            struct worker *w = &workers[i];
+            w->kind = k;
+            w->id = i;
+            w->seed = i + 1;
+            w->inode.i_cdev = &aesd_devices[i % aesd_nr_devs].cdev;
+            aesd_open(&w->inode, &w->filp);
+            if (pthread_create(&w->thread, NULL, worker_thread, w) != 0) {
+                perror("pthread_create");
+                return 1;
+            }
+        }
+    }
+
+    sleep(seconds);
+    atomic_store(&stop, true);
+    for (i = 0; i < nworkers; i++) {
+        pthread_join(workers[i].thread, NULL);
+        aesd_release(&workers[i].inode, &workers[i].filp);
+        ops[workers[i].kind] += workers[i].ops;
+        bytes[workers[i].kind] += workers[i].bytes;
+        errors[workers[i].kind] += workers[i].errors;
+        dev_ops[i % aesd_nr_devs] += workers[i].ops;
+    }
+    elapsed = ktime_get_ns() - start;
+
+    printf("%d writers, %d readers, %d seekers on %d devices for %.2fs, %zu byte commands\n",
+           threads[WORKER_WRITER], threads[WORKER_READER], threads[WORKER_SEEKER],
+           aesd_nr_devs, elapsed / 1e9, line_length);
+    printf("%-10s %12s %12s %12s %12s\n", "op", "count", "ops/s", "MB/s", "errors");
+    for (k = 0; k < WORKER_KINDS; k++) {
+        printf("%-10s %12llu %12.0f %12.1f %12llu\n", worker_kind_name[k], ops[k],
+               ops[k] / (elapsed / 1e9), bytes[k] / (elapsed / 1e3), errors[k]);
+    }
+
+    printf("\n%-10s %12s %12s %12s %12s\n", "device", "ops", "contended", "contended%", "avg_wait_ns");
+    for (i = 0; i < aesd_nr_devs; i++) {
+        struct aesd_stats *stats = &aesd_devices[i].stats;
+        printf("aesdchar%-2d %12llu %12llu %11.1f%% %12.0f\n", i, dev_ops[i],
+               stats->lock_contended,
+               dev_ops[i] ? 100.0 * stats->lock_contended / dev_ops[i] : 0.0,
+               stats->lock_contended ? (double)stats->lock_wait_ns / stats->lock_contended : 0.0);
+    }
+
+    for (i = 0; i < aesd_nr_devs; i++) {
+        if (verbose) {
+            char path[64];
+            printf("\n");
+            snprintf(path, sizeof(path), "aesdchar/aesdchar%d/stats", i);
+            aesd_shim_debugfs_show(path, stdout);
+            snprintf(path, sizeof(path), "aesdchar/aesdchar%d/latency", i);
+            aesd_shim_debugfs_show(path, stdout);
+        }
+        ok = verify_device(i) && ok;
+    }
+
+    aesd_cleanup_module();
+    free(dev_ops);
+    free(workers);
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,2 @@
+/* Userspace stand-in for <linux/seq_file.h>, see kshim.h */
+#include "kshim.h"
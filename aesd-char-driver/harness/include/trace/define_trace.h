@@ -0,0 +1,4 @@
+/*
+ * Userspace stand-in for <trace/define_trace.h>.  The kernel header includes the trace header
+ * again to generate the event code, here the events are empty functions, see kshim.h
+ */
@@ -0,0 +1,299 @@
+/**
+ * @file kshim.c
+ * @brief Out of line parts of the userspace kernel shim, see kshim.h
+ *
+ */
+
+#include "kshim.h"
+
+#define SHIM_CHRDEV_MAJOR 240 /* from the range reserved for local/experimental use */
+#define SHIM_DEBUGFS_NAME 64
+
+void *vmalloc_user(unsigned long size)
+{
+    void *addr = aligned_alloc(PAGE_SIZE, PAGE_ALIGN(size));
+
+    if (addr)
+        memset(addr, 0, PAGE_ALIGN(size));
+    return addr;
+}
+
+void vfree(const void *addr)
+{
+    free((void *)addr);
+}
+
+/**
+ * Set up @param i to cover the first @param count bytes of the @param nr_segs buffers at @param iov.
+ * @param direction is accepted for symmetry with the kernel and ignored.
+ */
+void iov_iter_init(struct iov_iter *i, unsigned int direction, const struct iovec *iov,
+                   unsigned long nr_segs, size_t count)
+{
+    (void)direction;
+    i->iov = iov;
+    i->nr_segs = nr_segs;
+    i->iov_offset = 0;
+    i->count = count;
+}
+
+/**
+ * Copy between @param addr and the iterator in the direction given by @param to_iter,
+ * advancing the iterator by the number of bytes copied
+ */
+static size_t iov_iter_copy(void *addr, size_t bytes, struct iov_iter *i, bool to_iter)
+{
+    size_t done = 0;
+
+    while (done < bytes && i->count && i->nr_segs) {
+        char *base = (char *)i->iov->iov_base + i->iov_offset;
+        size_t len = i->iov->iov_len - i->iov_offset;
+
+        if (len > bytes - done)
+            len = bytes - done;
+        if (len > i->count)
+            len = i->count;
+        if (to_iter)
+            memcpy(base, (char *)addr + done, len);
+        else
+            memcpy((char *)addr + done, base, len);
+        done += len;
+        i->count -= len;
+        i->iov_offset += len;
+        if (i->iov_offset == i->iov->iov_len) {
+            i->iov++;
+            i->nr_segs--;
+            i->iov_offset = 0;
+        }
+    }
+    return done;
+}
+
+size_t copy_to_iter(const void *addr, size_t bytes, struct iov_iter *i)
+{
+    return iov_iter_copy((void *)addr, bytes, i, true);
+}
+
+size_t copy_from_iter(void *addr, size_t bytes, struct iov_iter *i)
+{
+    return iov_iter_copy(addr, bytes, i, false);
+}
+
+/**
+ * @return true if all @param bytes were copied.  The kernel reverts the iterator on a short copy,
+ * which can't happen here since user memory never faults.
+ */
+bool copy_from_iter_full(void *addr, size_t bytes, struct iov_iter *i)
+{
+    return bytes <= i->count && copy_from_iter(addr, bytes, i) == bytes;
+}
+
+void cdev_init(struct cdev *cdev, const struct file_operations *fops)
+{
+    memset(cdev, 0, sizeof(*cdev));
+    cdev->ops = fops;
+}
+
+int cdev_add(struct cdev *cdev, dev_t dev, unsigned int count)
+{
+    (void)count;
+    cdev->dev = dev;
+    return 0;
+}
+
+void cdev_del(struct cdev *cdev)
+{
+    (void)cdev;
+}
+
+int alloc_chrdev_region(dev_t *dev, unsigned int baseminor, unsigned int count, const char *name)
+{
+    (void)count;
+    (void)name;
+    *dev = MKDEV(SHIM_CHRDEV_MAJOR, baseminor);
+    return 0;
+}
+
+void unregister_chrdev_region(dev_t from, unsigned int count)
+{
+    (void)from;
+    (void)count;
+}
+
+/**
+ * Seek within a file of @param size bytes, with the checks of the kernel's generic_file_llseek_size()
+ */
+loff_t fixed_size_llseek(struct file *file, loff_t offset, int whence, loff_t size)
+{
+    switch (whence) {
+    case SEEK_SET:
+        break;
+    case SEEK_CUR:
+        if (offset == 0)
+            return file->f_pos;
+        offset += file->f_pos;
+        break;
+    case SEEK_END:
+        offset += size;
+        break;
+    default:
+        return -EINVAL;
+    }
+    if (offset < 0 || offset > size)
+        return -EINVAL;
+    file->f_pos = offset;
+    return offset;
+}
+
+ssize_t copy_splice_read(struct file *in, loff_t *ppos, struct pipe_inode_info *pipe,
+                         size_t len, unsigned int flags)
+{
+    (void)in;
+    (void)ppos;
+    (void)pipe;
+    (void)len;
+    (void)flags;
+    return -EINVAL;
+}
+
+ssize_t iter_file_splice_write(struct pipe_inode_info *pipe, struct file *out, loff_t *ppos,
+                               size_t len, unsigned int flags)
+{
+    (void)pipe;
+    (void)out;
+    (void)ppos;
+    (void)len;
+    (void)flags;
+    return -EINVAL;
+}
+
+int remap_vmalloc_range(struct vm_area_struct *vma, void *addr, unsigned long pgoff)
+{
+    (void)vma;
+    (void)addr;
+    (void)pgoff;
+    return 0;
+}
+
+struct dentry {
+    char name[SHIM_DEBUGFS_NAME];
+    struct dentry *parent;
+    void *data;
+    const struct file_operations *fops;
+    struct dentry *next;
+};
+
+static struct dentry *debugfs_entries;
+static pthread_mutex_t debugfs_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct dentry *debugfs_create(const char *name, struct dentry *parent, void *data,
+                                     const struct file_operations *fops)
+{
+    struct dentry *dentry = calloc(1, sizeof(*dentry));
+
+    if (!dentry)
+        return NULL;
+    snprintf(dentry->name, sizeof(dentry->name), "%s", name);
+    dentry->parent = parent;
+    dentry->data = data;
+    dentry->fops = fops;
+
+    pthread_mutex_lock(&debugfs_lock);
+    dentry->next = debugfs_entries;
+    debugfs_entries = dentry;
+    pthread_mutex_unlock(&debugfs_lock);
+    return dentry;
+}
+
+struct dentry *debugfs_create_dir(const char *name, struct dentry *parent)
+{
+    return debugfs_create(name, parent, NULL, NULL);
+}
+
+struct dentry *debugfs_create_file(const char *name, unsigned int mode, struct dentry *parent,
+                                   void *data, const struct file_operations *fops)
+{
+    (void)mode;
+    return debugfs_create(name, parent, data, fops);
+}
+
+static bool debugfs_is_below(const struct dentry *dentry, const struct dentry *ancestor)
+{
+    for (; dentry; dentry = dentry->parent) {
+        if (dentry == ancestor)
+            return true;
+    }
+    return false;
+}
+
+void debugfs_remove_recursive(struct dentry *dentry)
+{
+    struct dentry **link;
+    struct dentry *removed = NULL;
+
+    if (!dentry)
+        return;
+
+    /* Unlink everything below dentry first, parents are still needed by debugfs_is_below() */
+    pthread_mutex_lock(&debugfs_lock);
+    link = &debugfs_entries;
+    while (*link) {
+        struct dentry *entry = *link;
+        if (debugfs_is_below(entry, dentry)) {
+            *link = entry->next;
+            entry->next = removed;
+            removed = entry;
+        } else {
+            link = &entry->next;
+        }
+    }
+    pthread_mutex_unlock(&debugfs_lock);
+
+    while (removed) {
+        struct dentry *next = removed->next;
+        free(removed);
+        removed = next;
+    }
+}
+
+/**
+ * @return true if @param path names @param dentry, following its parents up to the root
+ */
+static bool debugfs_path_matches(const struct dentry *dentry, const char *path)
+{
+    size_t len = strlen(path);
+
+    for (; dentry; dentry = dentry->parent) {
+        size_t name_len = strlen(dentry->name);
+
+        if (name_len > len || memcmp(path + len - name_len, dentry->name, name_len))
+            return false;
+        len -= name_len;
+        if (!dentry->parent)
+            return len == 0;
+        if (len == 0 || path[len - 1] != '/')
+            return false;
+        len--;
+    }
+    return false;
+}
+
+int aesd_shim_debugfs_show(const char *path, FILE *out)
+{
+    struct dentry *entry;
+    int retval = -ENOENT;
+
+    pthread_mutex_lock(&debugfs_lock);
+    for (entry = debugfs_entries; entry; entry = entry->next) {
+        if (entry->fops && entry->fops->show && debugfs_path_matches(entry, path)) {
+            struct seq_file s = {
+                .out = out,
+                .private = entry->data,
+            };
+            retval = entry->fops->show(&s, NULL);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&debugfs_lock);
+    return retval;
+}
@@ -0,0 +1,378 @@
+/*
+ * kshim.h
+ *
+ *  @brief Userspace stand-ins for the kernel interfaces used by ../main.c
+ *
+ *  Every <linux/...> header included by the driver resolves to a file under include/ which
+ *  includes this one, so main.c builds unmodified into a normal process where it can be run
+ *  under perf, gdb and the sanitizers.  Only what the driver uses is provided and the
+ *  semantics are the ones the driver relies on:
+ *
+ *  - mutexes and wait queues are pthread mutexes and condition variables, and the
+ *    interruptible variants are never interrupted
+ *  - kmalloc() and friends are malloc(), vmalloc_user() is a zeroed page aligned allocation
+ *  - copy_to_user() and copy_from_user() are memcpy(), user and kernel pointers are the same
+ *  - struct iov_iter walks an array of struct iovec, see iov_iter_init()
+ *  - module parameters are plain globals, module_init() and module_exit() do nothing and
+ *    the caller runs aesd_init_module() and aesd_cleanup_module() itself
+ *  - tracepoints compile to empty functions
+ *  - debugfs files are kept in a list and can be printed with aesd_shim_debugfs_show()
+ *
+ *  The kernel build never sees this directory.
+ */
+
+#ifndef AESD_KSHIM_H
+#define AESD_KSHIM_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
+
+/* Types */
+typedef unsigned long long u64;
+typedef long long s64;
+typedef uint32_t u32;
+typedef uint8_t u8;
+typedef unsigned int __poll_t;
+typedef struct {
+    long long counter;
+} atomic64_t;
+
+#define __user
+#define GFP_KERNEL 0
+#define ERESTARTSYS 512
+
+/* Kernel version checks take the paths of a current kernel */
+#define KERNEL_VERSION(a, b, c) (((a) << 16) + ((b) << 8) + ((c) > 255 ? 255 : (c)))
+#define LINUX_VERSION_CODE KERNEL_VERSION(6, 6, 0)
+
+/* Helpers */
+#define ARRAY_SIZE(arr) (sizeof(arr) / sizeof((arr)[0]))
+#define container_of(ptr, type, member) ((type *)((char *)(ptr) - offsetof(type, member)))
+#define min_t(type, a, b) ({ type __a = (a); type __b = (b); __a < __b ? __a : __b; })
+#define BUILD_BUG_ON(cond) _Static_assert(!(cond), #cond)
+#define READ_ONCE(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define WRITE_ONCE(x, val) __atomic_store_n(&(x), (val), __ATOMIC_RELAXED)
+#ifdef __SANITIZE_THREAD__
+/* ThreadSanitizer rejects fences, smp_wmb() only orders the mmap header which the harness never maps */
+#define smp_wmb() __asm__ __volatile__("" ::: "memory")
+#else
+#define smp_wmb() __atomic_thread_fence(__ATOMIC_RELEASE)
+#endif
+#define u64_to_user_ptr(x) ((void __user *)(uintptr_t)(x))
+
+static inline int fls64(u64 x)
+{
+    return x ? 64 - __builtin_clzll(x) : 0;
+}
+
+static inline void atomic64_inc(atomic64_t *v)
+{
+    __atomic_fetch_add(&v->counter, 1, __ATOMIC_RELAXED);
+}
+
+static inline s64 atomic64_read(const atomic64_t *v)
+{
+    return __atomic_load_n(&v->counter, __ATOMIC_RELAXED);
+}
+
+static inline u64 ktime_get_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Logging */
+#define KERN_ERR ""
+#define KERN_WARNING ""
+#define KERN_INFO ""
+#define KERN_DEBUG ""
+#define printk(fmt, args...) fprintf(stderr, fmt, ## args)
+
+/* Modules, the macros expand to redundant declarations so the trailing ';' stays valid */
+struct module;
+#define THIS_MODULE ((struct module *)0)
+#define module_param(name, type, perm) extern __typeof__(name) name
+#define MODULE_PARM_DESC(name, desc) extern __typeof__(name) name
+#define MODULE_AUTHOR(author) extern const char aesd_shim_modinfo[]
+#define MODULE_LICENSE(license) extern const char aesd_shim_modinfo[]
+#define module_init(fn) extern __typeof__(fn) fn
+#define module_exit(fn) extern __typeof__(fn) fn
+#ifndef S_IRUGO
+#define S_IRUGO (S_IRUSR | S_IRGRP | S_IROTH)
+#endif
+
+/* Memory */
+#define PAGE_SIZE 4096UL
+#define PAGE_ALIGN(x) (((x) + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1))
+
+static inline void *kmalloc(size_t size, int flags)
+{
+    (void)flags;
+    return malloc(size);
+}
+
+static inline void *kcalloc(size_t n, size_t size, int flags)
+{
+    (void)flags;
+    return calloc(n, size);
+}
+
+static inline void *krealloc(const void *p, size_t size, int flags)
+{
+    (void)flags;
+    return realloc((void *)p, size);
+}
+
+static inline void kfree(const void *p)
+{
+    free((void *)p);
+}
+
+extern void *vmalloc_user(unsigned long size);
+extern void vfree(const void *addr);
+
+static inline unsigned long copy_to_user(void __user *to, const void *from, unsigned long n)
+{
+    memcpy(to, from, n);
+    return 0;
+}
+
+static inline unsigned long copy_from_user(void *to, const void __user *from, unsigned long n)
+{
+    memcpy(to, from, n);
+    return 0;
+}
+
+/* Locking */
+struct mutex {
+    pthread_mutex_t m;
+};
+
+static inline void mutex_init(struct mutex *lock)
+{
+    pthread_mutex_init(&lock->m, NULL);
+}
+
+static inline void mutex_lock(struct mutex *lock)
+{
+    pthread_mutex_lock(&lock->m);
+}
+
+static inline int mutex_lock_interruptible(struct mutex *lock)
+{
+    pthread_mutex_lock(&lock->m);
+    return 0;
+}
+
+/**
+ * @return 1 if the mutex was acquired, 0 if it is held elsewhere, as in the kernel
+ */
+static inline int mutex_trylock(struct mutex *lock)
+{
+    return pthread_mutex_trylock(&lock->m) == 0;
+}
+
+static inline void mutex_unlock(struct mutex *lock)
+{
+    pthread_mutex_unlock(&lock->m);
+}
+
+typedef struct wait_queue_head {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} wait_queue_head_t;
+
+static inline void init_waitqueue_head(wait_queue_head_t *wq)
+{
+    pthread_mutex_init(&wq->lock, NULL);
+    pthread_cond_init(&wq->cond, NULL);
+}
+
+static inline void wake_up_interruptible(wait_queue_head_t *wq)
+{
+    pthread_mutex_lock(&wq->lock);
+    pthread_cond_broadcast(&wq->cond);
+    pthread_mutex_unlock(&wq->lock);
+}
+
+/*
+ * The condition is rechecked under wq->lock, which wake_up_interruptible() also takes, so a
+ * wakeup between the check and the wait is not lost
+ */
+#define wait_event_interruptible(wq, condition)             \
+({                                                          \
+    pthread_mutex_lock(&(wq).lock);                         \
+    while (!(condition))                                    \
+        pthread_cond_wait(&(wq).cond, &(wq).lock);          \
+    pthread_mutex_unlock(&(wq).lock);                       \
+    0;                                                      \
+})
+
+/* Files */
+#define MINORBITS 20
+#define MINORMASK ((1U << MINORBITS) - 1)
+#define MAJOR(dev) ((unsigned int)((dev) >> MINORBITS))
+#define MINOR(dev) ((unsigned int)((dev) & MINORMASK))
+#define MKDEV(ma, mi) (((dev_t)(ma) << MINORBITS) | (mi))
+
+#define IOCB_NOWAIT (1 << 7)
+
+struct file {
+    loff_t f_pos;
+    unsigned int f_flags;
+    void *private_data;
+};
+
+struct kiocb {
+    struct file *ki_filp;
+    loff_t ki_pos;
+    int ki_flags;
+};
+
+#define kvec iovec
+
+/**
+ * A sequence of user buffers to read into or write from, the part of the kernel
+ * struct iov_iter used by the driver
+ */
+struct iov_iter {
+    const struct iovec *iov;
+    unsigned long nr_segs;
+    size_t iov_offset;
+    size_t count;
+};
+
+static inline size_t iov_iter_count(const struct iov_iter *i)
+{
+    return i->count;
+}
+
+extern void iov_iter_init(struct iov_iter *i, unsigned int direction, const struct iovec *iov,
+                          unsigned long nr_segs, size_t count);
+extern size_t copy_to_iter(const void *addr, size_t bytes, struct iov_iter *i);
+extern size_t copy_from_iter(void *addr, size_t bytes, struct iov_iter *i);
+extern bool copy_from_iter_full(void *addr, size_t bytes, struct iov_iter *i);
+
+struct inode;
+struct seq_file;
+struct pipe_inode_info;
+struct vm_area_struct;
+typedef struct poll_table_struct {
+    int unused;
+} poll_table;
+
+struct file_operations {
+    struct module *owner;
+    ssize_t (*read_iter)(struct kiocb *, struct iov_iter *);
+    ssize_t (*write_iter)(struct kiocb *, struct iov_iter *);
+    ssize_t (*splice_read)(struct file *, loff_t *, struct pipe_inode_info *, size_t, unsigned int);
+    ssize_t (*splice_write)(struct pipe_inode_info *, struct file *, loff_t *, size_t, unsigned int);
+    int (*open)(struct inode *, struct file *);
+    int (*release)(struct inode *, struct file *);
+    loff_t (*llseek)(struct file *, loff_t, int);
+    long (*unlocked_ioctl)(struct file *, unsigned int, unsigned long);
+    int (*mmap)(struct file *, struct vm_area_struct *);
+    __poll_t (*poll)(struct file *, poll_table *);
+    /**
+     * Not in the kernel: the show function of a DEFINE_SHOW_ATTRIBUTE() file
+     */
+    int (*show)(struct seq_file *, void *);
+};
+
+struct cdev {
+    struct module *owner;
+    const struct file_operations *ops;
+    dev_t dev;
+};
+
+struct inode {
+    struct cdev *i_cdev;
+};
+
+extern void cdev_init(struct cdev *cdev, const struct file_operations *fops);
+extern int cdev_add(struct cdev *cdev, dev_t dev, unsigned int count);
+extern void cdev_del(struct cdev *cdev);
+extern int alloc_chrdev_region(dev_t *dev, unsigned int baseminor, unsigned int count, const char *name);
+extern void unregister_chrdev_region(dev_t from, unsigned int count);
+extern loff_t fixed_size_llseek(struct file *file, loff_t offset, int whence, loff_t size);
+
+extern ssize_t copy_splice_read(struct file *in, loff_t *ppos, struct pipe_inode_info *pipe,
+                                size_t len, unsigned int flags);
+extern ssize_t iter_file_splice_write(struct pipe_inode_info *pipe, struct file *out, loff_t *ppos,
+                                      size_t len, unsigned int flags);
+
+static inline void poll_wait(struct file *filp, wait_queue_head_t *wq, poll_table *p)
+{
+    (void)filp;
+    (void)wq;
+    (void)p;
+}
+
+/* mmap, the harness reads dev->mmap_area directly instead of mapping it */
+#define VM_WRITE    0x00000002UL
+#define VM_MAYWRITE 0x00000020UL
+
+struct vm_area_struct {
+    unsigned long vm_start;
+    unsigned long vm_end;
+    unsigned long vm_pgoff;
+    unsigned long vm_flags;
+};
+
+static inline void vm_flags_clear(struct vm_area_struct *vma, unsigned long flags)
+{
+    vma->vm_flags &= ~flags;
+}
+
+extern int remap_vmalloc_range(struct vm_area_struct *vma, void *addr, unsigned long pgoff);
+
+/* debugfs and seq_file */
+struct seq_file {
+    FILE *out;
+    void *private;
+};
+
+#define seq_printf(s, fmt, args...) fprintf((s)->out, fmt, ## args)
+
+#define DEFINE_SHOW_ATTRIBUTE(__name)                                   \
+static const struct file_operations __name ## _fops = {                 \
+    .owner = THIS_MODULE,                                               \
+    .show = __name ## _show,                                            \
+}
+
+struct dentry;
+extern struct dentry *debugfs_create_dir(const char *name, struct dentry *parent);
+extern struct dentry *debugfs_create_file(const char *name, unsigned int mode, struct dentry *parent,
+                                          void *data, const struct file_operations *fops);
+extern void debugfs_remove_recursive(struct dentry *dentry);
+
+/**
+ * Print the debugfs file at @param path, relative to the debugfs root (for instance
+ * "aesdchar/aesdchar0/stats"), to @param out
+ * @return 0 on success or -ENOENT if there is no such file
+ */
+extern int aesd_shim_debugfs_show(const char *path, FILE *out);
+
+/* Tracepoints, see include/linux/tracepoint.h */
+#define TP_PROTO(args...) args
+#define TP_ARGS(args...) args
+#define DECLARE_EVENT_CLASS(name, proto, args, tstruct, assign, print)
+#define DEFINE_EVENT(template, name, proto, args) \
+    static inline void trace_##name(proto) { }
+#define TRACE_EVENT(name, proto, args, tstruct, assign, print) \
+    static inline void trace_##name(proto) { }
+
+#endif /* AESD_KSHIM_H */
@@ -17,27 +17,174 @@
 #include <linux/types.h>
 #include <linux/cdev.h>
 #include <linux/fs.h> // file_operations
+#include <linux/slab.h>
+#include <linux/poll.h>
+#include <linux/wait.h>
+#include <linux/sched.h>
+#include <linux/uio.h>
+#include <linux/splice.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/version.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/ktime.h>
+#include <linux/uaccess.h>
 #include "aesdchar.h"
 #include "aesd_ioctl.h"
+
+#define CREATE_TRACE_POINTS
+#include "aesdchar_trace.h"
+
 int aesd_major =   0; // use dynamic major
 int aesd_minor =   0;
+int aesd_nr_devs = AESD_NR_DEVS; // number of /dev/aesdcharN devices
+bool aesd_tail_follow = false; // block reads at the end of the buffer until new data arrives
+
+module_param(aesd_nr_devs, int, S_IRUGO);
+MODULE_PARM_DESC(aesd_nr_devs, "Number of aesdchar devices, each with its own buffer and lock");
+module_param(aesd_tail_follow, bool, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(aesd_tail_follow, "Block reads at end of data until a new command is written, unless O_NONBLOCK");
 
 MODULE_AUTHOR("kudduesi"); /** TODO: fill in your name **/
 MODULE_LICENSE("Dual BSD/GPL");
 
-struct aesd_dev aesd_device;
+struct aesd_dev *aesd_devices; // allocated in aesd_init_module
+static struct dentry *aesd_debugfs_root;
 
 static size_t aesd_buffer_total_content_size(struct aesd_circular_buffer* buffer) {
 	size_t total_size = 0;
     uint8_t i;
     struct aesd_buffer_entry *entry;
-    AESD_CIRCULAR_BUFFER_FOREACH(entry, &aesd_device.buffer, i) {
+    AESD_CIRCULAR_BUFFER_FOREACH_LOGICAL(entry, buffer, i) {
     	total_size += entry->size;
     }
 
 	return total_size;
 }
 
+/**
+ * @return true if there is data to read at @param pos.  Must be called with dev->lock held.
+ */
+static bool aesd_data_ready(struct aesd_dev *dev, loff_t pos)
+{
+    return pos < aesd_buffer_total_content_size(&dev->buffer);
+}
+
+/**
+ * Take dev->lock, counting the times it was contended and how long the caller waited
+ * @return 0 on success or -ERESTARTSYS if interrupted while waiting
+ */
+static int aesd_lock(struct aesd_dev *dev)
+{
+    u64 start;
+
+    if (mutex_trylock(&dev->lock))
+        return 0;
+
+    start = ktime_get_ns();
+    if (mutex_lock_interruptible(&dev->lock))
+        return -ERESTARTSYS;
+    dev->stats.lock_contended++;
+    dev->stats.lock_wait_ns += ktime_get_ns() - start;
+    return 0;
+}
+
+static void aesd_record_latency(atomic64_t *histogram, u64 start)
+{
+    unsigned int bucket = fls64(ktime_get_ns() - start);
+
+    atomic64_inc(&histogram[min_t(unsigned int, bucket, AESD_LATENCY_BUCKETS - 1)]);
+}
+
+/**
+ * Start an update of the mmap header, readers will retry until aesd_mmap_end_update() is called.
+ * Must be called with dev->lock held.
+ */
+static void aesd_mmap_begin_update(struct aesd_dev *dev)
+{
+    struct aesd_mmap_header *hdr = dev->mmap_area;
+
+    WRITE_ONCE(hdr->seq, hdr->seq + 1);
+    smp_wmb();
+}
+
+/**
+ * Rebuild the mmap entry table from dev->buffer and complete the update
+ */
+static void aesd_mmap_end_update(struct aesd_dev *dev)
+{
+    struct aesd_mmap_header *hdr = dev->mmap_area;
+    uint8_t idx = dev->buffer.out_offs;
+    uint32_t count = 0;
+    uint64_t total = 0;
+
+    if (dev->buffer.full || dev->buffer.in_offs != dev->buffer.out_offs) {
+        do {
+            hdr->entry[count++] = dev->mmap_slot[idx];
+            total += dev->buffer.entry[idx].size;
+            idx = (idx + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+        } while (idx != dev->buffer.in_offs);
+    }
+    hdr->count = count;
+    hdr->total_bytes = total;
+
+    smp_wmb();
+    WRITE_ONCE(hdr->seq, hdr->seq + 1);
+}
+
+/**
+ * Copy @param entry into the mmap data region for the buffer slot it is about to occupy,
+ * invalidating any older command whose bytes are overwritten.
+ */
+static void aesd_mmap_place(struct aesd_dev *dev, const struct aesd_buffer_entry *entry)
+{
+    struct aesd_mmap_entry *slot = &dev->mmap_slot[dev->buffer.in_offs];
+    char *data = (char *)dev->mmap_area + AESD_MMAP_HEADER_SIZE;
+    uint32_t pos = dev->mmap_head;
+    uint8_t i;
+
+    slot->size = entry->size;
+    if (entry->size > AESD_MMAP_DATA_SIZE) {
+        slot->offset = AESD_MMAP_ENTRY_UNMAPPED;
+        return;
+    }
+    if (pos + entry->size > AESD_MMAP_DATA_SIZE)
+        pos = 0;
+
+    for (i = 0; i < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; i++) {
+        struct aesd_mmap_entry *other = &dev->mmap_slot[i];
+        if (other == slot || other->offset == AESD_MMAP_ENTRY_UNMAPPED)
+            continue;
+        if (other->offset < pos + entry->size && pos < other->offset + other->size)
+            other->offset = AESD_MMAP_ENTRY_UNMAPPED;
+    }
+
+    memcpy(data + pos, entry->buffptr, entry->size);
+    slot->offset = pos;
+    dev->mmap_head = pos + entry->size;
+}
+
+/**
+ * Add a completed write command to the device, freeing any entry it replaces.
+ * Must be called with dev->lock held.
+ */
+static void aesd_commit_entry(struct aesd_dev *dev, const struct aesd_buffer_entry *entry)
+{
+    const char *old;
+
+    aesd_mmap_begin_update(dev);
+    aesd_mmap_place(dev, entry);
+    old = aesd_circular_buffer_add_entry(&dev->buffer, entry);
+    aesd_mmap_end_update(dev);
+
+    if (old)
+        dev->stats.evictions++;
+    kfree(old);
+    dev->commits++;
+    wake_up_interruptible(&dev->readq);
+}
+
 int aesd_open(struct inode *inode, struct file *filp)
 {
     struct aesd_dev *dev = container_of(inode->i_cdev ,struct aesd_dev ,cdev);
@@ -52,52 +199,83 @@ int aesd_release(struct inode *inode, struct file *filp)
     return 0;
 }
 
-ssize_t aesd_read(struct file *filp, char __user *buf, size_t count,
-                loff_t *f_pos)
+static ssize_t aesd_do_read(struct kiocb *iocb, struct iov_iter *to)
 {
+    struct file *filp = iocb->ki_filp;
     struct aesd_dev *dev = filp->private_data;
+    loff_t *f_pos = &iocb->ki_pos;
+    size_t count = iov_iter_count(to);
+    struct kvec vec[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+    size_t nvec, i;
     ssize_t retval = 0;
     size_t read = 0;
 
     PDEBUG("read requested: count=%zu pos=%lld\n", count, *f_pos);
-    if (mutex_lock_interruptible(&dev->lock))
+    if (aesd_lock(dev))
         return -ERESTARTSYS;
+    dev->stats.reads++;
+
+    while (!aesd_data_ready(dev, *f_pos)) {
+        u64 commits = dev->commits;
+
+        mutex_unlock(&dev->lock);
+        if (!aesd_tail_follow)
+            return 0;
+        if ((filp->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT))
+            return -EAGAIN;
+
+        PDEBUG("read waiting for data: pos=%lld\n", *f_pos);
+        if (wait_event_interruptible(dev->readq, READ_ONCE(dev->commits) != commits))
+            return -ERESTARTSYS;
+        if (aesd_lock(dev))
+            return -ERESTARTSYS;
+    }
 
-    while (read < count) {
-        size_t entry_off;
-        struct aesd_buffer_entry *ent =
-            aesd_circular_buffer_find_entry_offset_for_fpos(
-                &dev->buffer, *f_pos, &entry_off);
-        size_t to_copy;
+    aesd_circular_buffer_export_range(&dev->buffer, *f_pos, count,
+                                      vec, ARRAY_SIZE(vec), &nvec);
+    for (i = 0; i < nvec; i++) {
+        size_t copied = copy_to_iter(vec[i].iov_base, vec[i].iov_len, to);
 
-        if (!ent)
+        read += copied;
+        if (copied != vec[i].iov_len)
             break;
-
-        to_copy = min(ent->size - entry_off, count - read);
-        if (copy_to_user(buf + read, ent->buffptr + entry_off, to_copy)) {
-            retval = -EFAULT;
-            goto read_done;
-        }
-        read += to_copy;
-        *f_pos += to_copy;
-        retval = read;
     }
+    *f_pos += read;
+    retval = read;
+    if (nvec && !read)
+        retval = -EFAULT;
 
-read_done:
     mutex_unlock(&dev->lock);
     return retval;
 }
 
-ssize_t aesd_write(struct file *filp, const char __user *buf, size_t count,
-                loff_t *f_pos)
+ssize_t aesd_read_iter(struct kiocb *iocb, struct iov_iter *to)
 {
-    struct aesd_dev *dev = filp->private_data;
+    struct aesd_dev *dev = iocb->ki_filp->private_data;
+    loff_t pos = iocb->ki_pos;
+    size_t count = iov_iter_count(to);
+    u64 start = ktime_get_ns();
+    ssize_t retval = aesd_do_read(iocb, to);
+
+    aesd_record_latency(dev->stats.read_latency, start);
+    trace_aesd_read(MINOR(dev->cdev.dev), pos, count, retval);
+    return retval;
+}
+
+static ssize_t aesd_do_write(struct kiocb *iocb, struct iov_iter *from)
+{
+    struct aesd_dev *dev = iocb->ki_filp->private_data;
+    size_t count = iov_iter_count(from);
     ssize_t retval = -ENOMEM;
+    size_t search_from;
     char *newline;
 
     PDEBUG("write requested: count=%zu\n", count);
-    if (mutex_lock_interruptible(&dev->lock))
+    if (!count)
+        return 0;
+    if (aesd_lock(dev))
         return -ERESTARTSYS;
+    dev->stats.writes++;
 
     if (dev->work.buffptr) {
         char *tmp = krealloc(dev->work.buffptr,
@@ -116,42 +294,47 @@ ssize_t aesd_write(struct file *filp, const char __user *buf, size_t count,
         }
     }
 
-    if (copy_from_user(dev->work.buffptr + dev->work.size,
-                       buf, count)) {
+    if (!copy_from_iter_full((char *)dev->work.buffptr + dev->work.size,
+                             count, from)) {
         retval = -EFAULT;
         goto write_done;
     }
+    search_from = dev->work.size;
     dev->work.size += count;
+    dev->stats.bytes_written += count;
     retval = count;
 
-    newline = memchr(dev->work.buffptr, '\n', dev->work.size);
-    if (newline) {
+    /* A gathered write may carry several commands, commit each complete one */
+    while ((newline = memchr(dev->work.buffptr + search_from, '\n',
+                             dev->work.size - search_from))) {
         size_t entry_len = newline - dev->work.buffptr + 1;
         struct aesd_buffer_entry new = {
             .buffptr = dev->work.buffptr,
             .size = entry_len,
         };
-        const char *old = aesd_circular_buffer_add_entry(
-                            &dev->buffer, &new);
-        if (old)
-            kfree((void *)old);
-
-        if (dev->work.size > entry_len) {
-            size_t rem = dev->work.size - entry_len;
-            char *keep = kmalloc(rem, GFP_KERNEL);
+        size_t rem = dev->work.size - entry_len;
+        char *keep = NULL;
+
+        if (rem) {
+            keep = kmalloc(rem, GFP_KERNEL);
             if (keep) {
                 memcpy(keep, dev->work.buffptr + entry_len, rem);
-                dev->work.buffptr = keep;
-                dev->work.size = rem;
             } else {
-                kfree(dev->work.buffptr);
-                dev->work.buffptr = NULL;
-                dev->work.size = 0;
+                /*
+                 * The rest of the write is dropped, return a short write so userspace only
+                 * writes that again and not the command committed here as well
+                 */
+                retval = count - rem;
+                dev->stats.bytes_written -= rem;
             }
-        } else {
-            dev->work.buffptr = NULL;
-            dev->work.size = 0;
         }
+        aesd_commit_entry(dev, &new);
+
+        dev->work.buffptr = keep;
+        dev->work.size = keep ? rem : 0;
+        if (!keep)
+            break;
+        search_from = 0;
     }
 
 write_done:
@@ -159,139 +342,430 @@ write_done:
     return retval;
 }
 
+ssize_t aesd_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+    struct aesd_dev *dev = iocb->ki_filp->private_data;
+    size_t count = iov_iter_count(from);
+    u64 start = ktime_get_ns();
+    ssize_t retval = aesd_do_write(iocb, from);
+
+    aesd_record_latency(dev->stats.write_latency, start);
+    trace_aesd_write(MINOR(dev->cdev.dev), iocb->ki_pos, count, retval);
+    return retval;
+}
+
 loff_t aesd_llseek(struct file *filp, loff_t offset, int whence) {
-	PDEBUG("aesd_llseek: offset %ld bytes, whence %d", offset, whence);
+	PDEBUG("aesd_llseek: offset %lld bytes, whence %d\n", offset, whence);
 	
     loff_t retval = 0;
     struct aesd_dev *dev = (struct aesd_dev *)filp->private_data;
     
-    if (mutex_lock_interruptible(&dev->lock)) {
-        PDEBUG("aesd_llseek: mutex lock failed");
+    if (aesd_lock(dev)) {
+        PDEBUG("aesd_llseek: mutex lock failed\n");
         return -ERESTARTSYS;
     }
     
     size_t total_size = aesd_buffer_total_content_size(&dev->buffer);
     retval = fixed_size_llseek(filp, offset, whence, (loff_t)total_size);
-    PDEBUG("aesd_llseek: fixed_size_llseek() return %d", retval);
+    PDEBUG("aesd_llseek: fixed_size_llseek() return %lld\n", retval);
     
     mutex_unlock(&dev->lock);
+    trace_aesd_llseek(MINOR(dev->cdev.dev), offset, whence, retval);
     
     return retval;
 }
 
+/**
+ * @return the file position of byte @param write_cmd_offset of the @param write_cmd oldest command,
+ * or -EINVAL if there is no such byte.  Must be called with dev->lock held.
+ */
+static loff_t aesd_seekto_fpos(struct aesd_dev *dev, uint32_t write_cmd, uint32_t write_cmd_offset)
+{
+	loff_t start_offset = 0;
+	struct aesd_buffer_entry *entry;
+	uint8_t i;
+
+	if (write_cmd >= aesd_circular_buffer_count(&dev->buffer)) {
+		PDEBUG("aesd_seekto_fpos: invalid write_cmd : %u\n", write_cmd);
+		return -EINVAL;
+	}
+
+	AESD_CIRCULAR_BUFFER_FOREACH_LOGICAL(entry, &dev->buffer, i) {
+		if (i == write_cmd)
+			break;
+		start_offset += entry->size;
+	}
+
+	if (write_cmd_offset >= entry->size) {
+		PDEBUG("aesd_seekto_fpos: invalid write_cmd_offset : %u\n", write_cmd_offset);
+		return -EINVAL;
+	}
+
+	return start_offset + write_cmd_offset;
+}
+
 static long aesd_adjust_file_offset(struct file* filp, unsigned int write_cmd, unsigned int write_cmd_offset) {
     long retval = 0;
     struct aesd_dev *dev = (struct aesd_dev *)filp->private_data;
+    loff_t pos;
 
-    if (mutex_lock_interruptible(&dev->lock)) {
-        PDEBUG("aesd_adjust_file_offset: mutex lock failed");
+    if (aesd_lock(dev)) {
+        PDEBUG("aesd_adjust_file_offset: mutex lock failed\n");
         return -ERESTARTSYS;
     }
 
-	if (write_cmd >= AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED) {
-		PDEBUG("aesd_adjust_file_offset: invalid write_cmd : %zu", write_cmd);
-		retval = -EINVAL;
-		goto aesd_adjust_unlock;
-	}
-
-	if (write_cmd_offset >= dev->buffer.entry[write_cmd].size) {
-		PDEBUG("aesd_adjust_file_offset: invalid write_cmd_offset : %zu", write_cmd_offset);
-		retval = -EINVAL;
-		goto aesd_adjust_unlock;	
-	}
+	pos = aesd_seekto_fpos(dev, write_cmd, write_cmd_offset);
+	if (pos < 0)
+		retval = pos;
+	else
+		filp->f_pos = pos;
 
-	loff_t start_offset = 0;
-	for (int i = 0; i < write_cmd; i++) {
-		start_offset += dev->buffer.entry[i].size;
-	}
-		
-	filp->f_pos = start_offset + write_cmd_offset;
-
-aesd_adjust_unlock:
 	mutex_unlock(&dev->lock);
     
 	return retval;
 }
 
-long aesd_ioctl(struct file *filp, unsigned int cmd, unsigned long arg) {
-	PDEBUG("aesd_ioctl: cmd %zu, arg %zu", cmd, arg);
+/**
+ * Seek to the command and offset in @param ra and copy up to ra->len bytes to ra->buf, leaving
+ * the file position after the last byte copied, as AESDCHAR_IOCSEEKTO followed by read() would.
+ */
+static long aesd_read_at(struct file *filp, struct aesd_read_at *ra)
+{
+    struct aesd_dev *dev = filp->private_data;
+    char __user *buf = u64_to_user_ptr(ra->buf);
+    struct kvec vec[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+    size_t nvec, i;
+    long retval = 0;
+    loff_t pos;
+
+    ra->bytes_read = 0;
+    if (aesd_lock(dev))
+        return -ERESTARTSYS;
+
+    pos = aesd_seekto_fpos(dev, ra->seekto.write_cmd, ra->seekto.write_cmd_offset);
+    if (pos < 0) {
+        retval = pos;
+        goto read_at_done;
+    }
+
+    aesd_circular_buffer_export_range(&dev->buffer, pos,
+                                      min_t(u64, ra->len, SIZE_MAX),
+                                      vec, ARRAY_SIZE(vec), &nvec);
+    for (i = 0; i < nvec; i++) {
+        if (copy_to_user(buf + ra->bytes_read, vec[i].iov_base, vec[i].iov_len)) {
+            retval = -EFAULT;
+            break;
+        }
+        ra->bytes_read += vec[i].iov_len;
+    }
+    filp->f_pos = pos + ra->bytes_read;
+    dev->stats.reads++;
+
+read_at_done:
+    mutex_unlock(&dev->lock);
+    return retval;
+}
+
+/**
+ * Fill @param table with the size and sequence number of each stored command, oldest first
+ */
+static long aesd_get_table(struct aesd_dev *dev, struct aesd_entry_table *table)
+{
+    struct aesd_buffer_entry *entry;
+    uint8_t i;
+
+    memset(table, 0, sizeof(*table));
+    if (aesd_lock(dev))
+        return -ERESTARTSYS;
+
+    table->count = aesd_circular_buffer_count(&dev->buffer);
+    AESD_CIRCULAR_BUFFER_FOREACH_LOGICAL(entry, &dev->buffer, i) {
+        table->entry[i].seq = dev->commits - table->count + i;
+        table->entry[i].size = entry->size;
+        table->total_bytes += entry->size;
+    }
+
+    mutex_unlock(&dev->lock);
+    return 0;
+}
+
+static long aesd_do_ioctl(struct file *filp, unsigned int cmd, unsigned long arg) {
+	PDEBUG("aesd_ioctl: cmd %u, arg %lu\n", cmd, arg);
 	
 	long retval = 0;
 	
+	if (_IOC_TYPE(cmd) != AESD_IOC_MAGIC || _IOC_NR(cmd) > AESDCHAR_IOC_MAXNR)
+		return -ENOTTY;
+
 	switch (cmd) {
 	case AESDCHAR_IOCSEEKTO:
 	{
 		struct aesd_seekto seekto;
-		if (copy_from_user(&seekto, (struct aesd_seekto *)arg, sizeof(seekto))) {
-			return EFAULT;
+		if (copy_from_user(&seekto, (struct aesd_seekto __user *)arg, sizeof(seekto))) {
+			return -EFAULT;
 		}
 		
 		retval = aesd_adjust_file_offset(filp, seekto.write_cmd, seekto.write_cmd_offset);
-		PDEBUG("aesd_ioctl: aesd_adjust_file_offset() return %d", retval);
+		PDEBUG("aesd_ioctl: aesd_adjust_file_offset() return %ld\n", retval);
+		break;
+	}
+	case AESDCHAR_IOCREADAT:
+	{
+		struct aesd_read_at ra;
+		if (copy_from_user(&ra, (struct aesd_read_at __user *)arg, sizeof(ra))) {
+			return -EFAULT;
+		}
+
+		retval = aesd_read_at(filp, &ra);
+		if (!retval && copy_to_user((struct aesd_read_at __user *)arg, &ra, sizeof(ra))) {
+			retval = -EFAULT;
+		}
+		break;
+	}
+	case AESDCHAR_IOCGETTABLE:
+	{
+		struct aesd_entry_table table;
+
+		retval = aesd_get_table(filp->private_data, &table);
+		if (!retval && copy_to_user((struct aesd_entry_table __user *)arg, &table, sizeof(table))) {
+			retval = -EFAULT;
+		}
+		break;
 	}
 	default:
-		return -EFAULT;
+		retval = -ENOTTY;
+		break;
 	}
+
+	return retval;
+}
+
+long aesd_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+    struct aesd_dev *dev = filp->private_data;
+    long retval = aesd_do_ioctl(filp, cmd, arg);
+
+    trace_aesd_ioctl(MINOR(dev->cdev.dev), cmd, retval);
+    return retval;
+}
+
+/**
+ * Report the device readable when there is data beyond the file position, writes never block.
+ */
+__poll_t aesd_poll(struct file *filp, poll_table *wait)
+{
+    struct aesd_dev *dev = filp->private_data;
+    __poll_t mask = EPOLLOUT | EPOLLWRNORM;
+
+    poll_wait(filp, &dev->readq, wait);
+
+    mutex_lock(&dev->lock);
+    if (aesd_data_ready(dev, filp->f_pos))
+        mask |= EPOLLIN | EPOLLRDNORM;
+    mutex_unlock(&dev->lock);
+
+    return mask;
+}
+
+/**
+ * Map the header page and data region described in aesd_mmap.h.  The mapping is read-only,
+ * commands are only ever added through write().
+ */
+int aesd_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+    struct aesd_dev *dev = filp->private_data;
+
+    PDEBUG("mmap requested: pgoff=%lu size=%lu\n", vma->vm_pgoff,
+           vma->vm_end - vma->vm_start);
+    if (vma->vm_flags & VM_WRITE)
+        return -EPERM;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+    vm_flags_clear(vma, VM_MAYWRITE);
+#else
+    vma->vm_flags &= ~VM_MAYWRITE;
+#endif
+    return remap_vmalloc_range(vma, dev->mmap_area, vma->vm_pgoff);
 }
 
 struct file_operations aesd_fops = {
     .owner =    THIS_MODULE,
-    .read =     aesd_read,
-    .write =    aesd_write,
+    .read_iter =  aesd_read_iter,
+    .write_iter = aesd_write_iter,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 5, 0)
+    .splice_read = copy_splice_read,
+#else
+    .splice_read = generic_file_splice_read,
+#endif
+    .splice_write = iter_file_splice_write,
     .open =     aesd_open,
     .release =  aesd_release,
     .llseek =   aesd_llseek,
     .unlocked_ioctl = aesd_ioctl,
+    .mmap =     aesd_mmap,
+    .poll =     aesd_poll,
 };
 
-static int aesd_setup_cdev(struct aesd_dev *dev)
+static int aesd_setup_cdev(struct aesd_dev *dev, int index)
 {
-    int err, devno = MKDEV(aesd_major, aesd_minor);
+    int err, devno = MKDEV(aesd_major, aesd_minor + index);
 
     cdev_init(&dev->cdev, &aesd_fops);
     dev->cdev.owner = THIS_MODULE;
     dev->cdev.ops = &aesd_fops;
     err = cdev_add (&dev->cdev, devno, 1);
     if (err) {
-        printk(KERN_ERR "Error %d adding aesd cdev", err);
+        printk(KERN_ERR "Error %d adding aesd cdev %d", err, index);
     }
     return err;
 }
 
 
 
+static int aesd_mmap_init(struct aesd_dev *dev)
+{
+    struct aesd_mmap_header *hdr;
+
+    BUILD_BUG_ON(sizeof(struct aesd_mmap_header) > AESD_MMAP_HEADER_SIZE);
+    dev->mmap_area = vmalloc_user(PAGE_ALIGN(AESD_MMAP_SIZE));
+    if (!dev->mmap_area)
+        return -ENOMEM;
+
+    hdr = dev->mmap_area;
+    hdr->magic = AESD_MMAP_MAGIC;
+    hdr->version = AESD_MMAP_VERSION;
+    hdr->data_offset = AESD_MMAP_HEADER_SIZE;
+    hdr->data_size = AESD_MMAP_DATA_SIZE;
+    return 0;
+}
+
+static int aesd_stats_show(struct seq_file *s, void *unused)
+{
+    struct aesd_dev *dev = s->private;
+
+    mutex_lock(&dev->lock);
+    seq_printf(s, "reads: %llu\n", dev->stats.reads);
+    seq_printf(s, "writes: %llu\n", dev->stats.writes);
+    seq_printf(s, "commits: %llu\n", dev->commits);
+    seq_printf(s, "evictions: %llu\n", dev->stats.evictions);
+    seq_printf(s, "bytes_written: %llu\n", dev->stats.bytes_written);
+    seq_printf(s, "bytes_stored: %zu\n", aesd_buffer_total_content_size(&dev->buffer));
+    seq_printf(s, "lock_contended: %llu\n", dev->stats.lock_contended);
+    seq_printf(s, "lock_wait_ns: %llu\n", dev->stats.lock_wait_ns);
+    mutex_unlock(&dev->lock);
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(aesd_stats);
+
+static int aesd_latency_show(struct seq_file *s, void *unused)
+{
+    struct aesd_dev *dev = s->private;
+    int i;
+
+    seq_printf(s, "%-12s %12s %12s\n", "ns_below", "read", "write");
+    for (i = 0; i < AESD_LATENCY_BUCKETS; i++) {
+        if (i == AESD_LATENCY_BUCKETS - 1)
+            seq_printf(s, "%-12s", "inf");
+        else
+            seq_printf(s, "%-12llu", 1ULL << i);
+        seq_printf(s, " %12lld %12lld\n",
+                   (long long)atomic64_read(&dev->stats.read_latency[i]),
+                   (long long)atomic64_read(&dev->stats.write_latency[i]));
+    }
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(aesd_latency);
+
+/**
+ * Create /sys/kernel/debug/aesdchar/aesdcharN/{stats,latency} for @param dev.
+ * Failures are not fatal, debugfs is for diagnostics only.
+ */
+static void aesd_debugfs_add(struct aesd_dev *dev, int index)
+{
+    char name[24];
+    struct dentry *dir;
+
+    snprintf(name, sizeof(name), "aesdchar%d", index);
+    dir = debugfs_create_dir(name, aesd_debugfs_root);
+    debugfs_create_file("stats", 0444, dir, dev, &aesd_stats_fops);
+    debugfs_create_file("latency", 0444, dir, dev, &aesd_latency_fops);
+}
+
+static void aesd_free_dev(struct aesd_dev *dev)
+{
+    uint8_t i;
+    struct aesd_buffer_entry *entry;
+
+    AESD_CIRCULAR_BUFFER_FOREACH(entry, &dev->buffer, i) {
+        kfree(entry->buffptr);
+    }
+    kfree(dev->work.buffptr);
+    vfree(dev->mmap_area);
+}
+
 int aesd_init_module(void)
 {
     dev_t dev;
-    int result;
+    int result, i;
+
+    if (aesd_nr_devs < 1)
+        return -EINVAL;
 
-    result = alloc_chrdev_region(&dev, aesd_minor, 1, "aesdchar");
+    result = alloc_chrdev_region(&dev, aesd_minor, aesd_nr_devs, "aesdchar");
     if (result < 0)
         return result;
     aesd_major = MAJOR(dev);
 
-    memset(&aesd_device, 0, sizeof(aesd_device));
-    mutex_init(&aesd_device.lock);
-    aesd_circular_buffer_init(&aesd_device.buffer);
+    aesd_devices = kcalloc(aesd_nr_devs, sizeof(struct aesd_dev), GFP_KERNEL);
+    if (!aesd_devices) {
+        result = -ENOMEM;
+        goto fail_region;
+    }
+    aesd_debugfs_root = debugfs_create_dir("aesdchar", NULL);
+
+    for (i = 0; i < aesd_nr_devs; i++) {
+        struct aesd_dev *aesd_device = &aesd_devices[i];
+
+        mutex_init(&aesd_device->lock);
+        init_waitqueue_head(&aesd_device->readq);
+        aesd_circular_buffer_init(&aesd_device->buffer);
+
+        result = aesd_mmap_init(aesd_device);
+        if (result)
+            goto fail_devs;
+
+        result = aesd_setup_cdev(aesd_device, i);
+        if (result) {
+            aesd_free_dev(aesd_device);
+            goto fail_devs;
+        }
+        aesd_debugfs_add(aesd_device, i);
+    }
+    return 0;
 
-    result = aesd_setup_cdev(&aesd_device);
-    if (result)
-        unregister_chrdev_region(dev, 1);
+fail_devs:
+    debugfs_remove_recursive(aesd_debugfs_root);
+    while (i--) {
+        cdev_del(&aesd_devices[i].cdev);
+        aesd_free_dev(&aesd_devices[i]);
+    }
+    kfree(aesd_devices);
+fail_region:
+    unregister_chrdev_region(dev, aesd_nr_devs);
     return result;
 }
 
 void aesd_cleanup_module(void)
 {
     dev_t devno = MKDEV(aesd_major, aesd_minor);
-    uint8_t i;
-    struct aesd_buffer_entry *entry;
+    int i;
 
-    cdev_del(&aesd_device.cdev);
-    AESD_CIRCULAR_BUFFER_FOREACH(entry, &aesd_device.buffer, i) {
-        kfree(entry->buffptr);
+    debugfs_remove_recursive(aesd_debugfs_root);
+    for (i = 0; i < aesd_nr_devs; i++) {
+        cdev_del(&aesd_devices[i].cdev);
+        aesd_free_dev(&aesd_devices[i]);
     }
-    kfree(aesd_device.work.buffptr);
-    unregister_chrdev_region(devno, 1);
+    kfree(aesd_devices);
+    unregister_chrdev_region(devno, aesd_nr_devs);
 }
 
 
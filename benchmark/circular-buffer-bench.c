@@ -0,0 +1,382 @@
+/**
+ * @file circular-buffer-bench.c
+ * @brief Microbenchmarks for aesd-circular-buffer.c
+ *
+ * Built once per buffer capacity (see CMakeLists.txt), measures adding entries to a buffer which
+ * is filling up and one which is full and evicting, and looking up offsets with several access
+ * patterns and entry sizes.  For each case the fastest ns/op of several runs is reported, which is
+ * less sensitive to scheduling noise than the mean or median, along with
+ * the number of entries examined per lookup and, when the kernel allows it, hardware cache misses
+ * per op.  Results are compared against a baseline file and the run fails when any case is slower
+ * than the baseline by more than the threshold.  A case which looks slower is re-run a few times
+ * first, so a single burst of scheduling noise does not fail the run.
+ *
+ * Usage: circular-buffer-bench [--baseline <file>] [--threshold <percent>] [--update-baseline]
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "../aesd-char-driver/aesd-circular-buffer.h"
+
+#define BENCH_RUNS           7
+#define BENCH_MIN_NS         20000000ULL  /* each run lasts at least 20ms */
+#define BENCH_MAX_CASES      32
+#define BENCH_NAME_LEN       64
+#define BENCH_DEFAULT_THRESHOLD 25.0
+#define BENCH_RETRIES        3            /* re-runs of a case before reporting it as a regression */
+
+struct bench_result {
+    char name[BENCH_NAME_LEN];
+    double ns_per_op;
+    double entries_per_op;
+    double cache_misses_per_op; /* negative when not available */
+};
+
+struct bench_case {
+    const char *name;
+    size_t entry_size;
+    /* Returns the number of entries examined, summed over @param ops operations */
+    uint64_t (*run)(struct aesd_circular_buffer *buffer, size_t entry_size, uint64_t ops);
+};
+
+static struct bench_result results[BENCH_MAX_CASES];
+static char entry_storage[4096];
+static volatile uintptr_t sink;
+static int perf_fd = -1;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Open a counter for hardware cache misses of this thread, leaving perf_fd at -1 when the
+ * kernel or container does not allow it.
+ */
+static void perf_open(void)
+{
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    perf_fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static void perf_start(void)
+{
+    if (perf_fd >= 0) {
+        ioctl(perf_fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(perf_fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+}
+
+static int64_t perf_stop(void)
+{
+    uint64_t count;
+
+    if (perf_fd < 0) {
+        return -1;
+    }
+    ioctl(perf_fd, PERF_EVENT_IOC_DISABLE, 0);
+    if (read(perf_fd, &count, sizeof(count)) != sizeof(count)) {
+        return -1;
+    }
+    return (int64_t)count;
+}
+
+/**
+ * Fill @param buffer with entries of @param entry_size bytes
+ */
+static void fill(struct aesd_circular_buffer *buffer, size_t entry_size)
+{
+    struct aesd_buffer_entry entry = { .buffptr = entry_storage, .size = entry_size };
+    int i;
+
+    aesd_circular_buffer_init(buffer);
+    for (i = 0; i < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; i++) {
+        aesd_circular_buffer_add_entry(buffer, &entry);
+    }
+}
+
+static uint64_t bench_add_filling(struct aesd_circular_buffer *buffer, size_t entry_size, uint64_t ops)
+{
+    struct aesd_buffer_entry entry = { .buffptr = entry_storage, .size = entry_size };
+    uint64_t i;
+
+    for (i = 0; i < ops; i++) {
+        if (i % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED == 0) {
+            aesd_circular_buffer_init(buffer);
+        }
+        sink += (uintptr_t)aesd_circular_buffer_add_entry(buffer, &entry);
+    }
+    return ops;
+}
+
+static uint64_t bench_add_evicting(struct aesd_circular_buffer *buffer, size_t entry_size, uint64_t ops)
+{
+    struct aesd_buffer_entry entry = { .buffptr = entry_storage, .size = entry_size };
+    uint64_t i;
+
+    fill(buffer, entry_size);
+    for (i = 0; i < ops; i++) {
+        sink += (uintptr_t)aesd_circular_buffer_add_entry(buffer, &entry);
+    }
+    return ops;
+}
+
+/**
+ * Look up @param ops offsets produced by @param next, returning the entries examined
+ */
+static uint64_t bench_find(struct aesd_circular_buffer *buffer, size_t entry_size, uint64_t ops,
+        size_t (*next)(uint64_t i, size_t total))
+{
+    size_t total = entry_size * AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+    uint64_t examined = 0;
+    uint64_t i;
+
+    fill(buffer, entry_size);
+    for (i = 0; i < ops; i++) {
+        size_t offset = next(i, total);
+        size_t entry_offset;
+        sink += (uintptr_t)aesd_circular_buffer_find_entry_offset_for_fpos(buffer, offset, &entry_offset);
+        examined += offset / entry_size + 1;
+    }
+    return examined;
+}
+
+static size_t offset_head(uint64_t i, size_t total)
+{
+    return i & 7;
+}
+
+static size_t offset_tail(uint64_t i, size_t total)
+{
+    return total - 1 - (i & 7);
+}
+
+static size_t offset_sequential(uint64_t i, size_t total)
+{
+    return (i * 61) % total;
+}
+
+static size_t offset_random(uint64_t i, size_t total)
+{
+    /* splitmix64, cheap enough not to dominate the lookup */
+    uint64_t z = i + 0x9e3779b97f4a7c15ULL;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return (z ^ (z >> 31)) % total;
+}
+
+static uint64_t bench_find_head(struct aesd_circular_buffer *buffer, size_t entry_size, uint64_t ops)
+{
+    return bench_find(buffer, entry_size, ops, offset_head);
+}
+
+static uint64_t bench_find_tail(struct aesd_circular_buffer *buffer, size_t entry_size, uint64_t ops)
+{
+    return bench_find(buffer, entry_size, ops, offset_tail);
+}
+
+static uint64_t bench_find_sequential(struct aesd_circular_buffer *buffer, size_t entry_size, uint64_t ops)
+{
+    return bench_find(buffer, entry_size, ops, offset_sequential);
+}
+
+static uint64_t bench_find_random(struct aesd_circular_buffer *buffer, size_t entry_size, uint64_t ops)
+{
+    return bench_find(buffer, entry_size, ops, offset_random);
+}
+
+static const struct bench_case cases[] = {
+    { "add_filling",          16,   bench_add_filling },
+    { "add_evicting",         16,   bench_add_evicting },
+    { "find_head",            16,   bench_find_head },
+    { "find_tail",            16,   bench_find_tail },
+    { "find_sequential",      16,   bench_find_sequential },
+    { "find_random",          16,   bench_find_random },
+    { "find_random",          256,  bench_find_random },
+    { "find_random",          4096, bench_find_random },
+};
+
+/**
+ * Run @param c BENCH_RUNS times, each for at least BENCH_MIN_NS, and record the fastest
+ */
+static void run_case(const struct bench_case *c, struct bench_result *r)
+{
+    struct aesd_circular_buffer buffer;
+    double ns[BENCH_RUNS];
+    uint64_t ops = 1024;
+    uint64_t examined = 0;
+    int64_t misses = 0;
+    double best;
+    int run;
+    int i;
+
+    /* Calibrate the number of operations so a run lasts BENCH_MIN_NS */
+    for (;;) {
+        uint64_t start = now_ns();
+        c->run(&buffer, c->entry_size, ops);
+        if (now_ns() - start >= BENCH_MIN_NS / 4) {
+            break;
+        }
+        ops *= 2;
+    }
+    ops *= 4;
+
+    for (run = 0; run < BENCH_RUNS; run++) {
+        uint64_t start;
+        int64_t run_misses;
+
+        perf_start();
+        start = now_ns();
+        examined = c->run(&buffer, c->entry_size, ops);
+        ns[run] = (double)(now_ns() - start) / ops;
+        run_misses = perf_stop();
+        misses = (run_misses < 0 || misses < 0) ? -1 : misses + run_misses;
+    }
+
+    best = ns[0];
+    for (i = 1; i < BENCH_RUNS; i++) {
+        if (ns[i] < best) {
+            best = ns[i];
+        }
+    }
+
+    snprintf(r->name, sizeof(r->name), "cap%d_%s_%zu", AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED,
+            c->name, c->entry_size);
+    r->ns_per_op = best;
+    r->entries_per_op = (double)examined / ops;
+    r->cache_misses_per_op = misses < 0 ? -1.0 : (double)misses / ((double)ops * BENCH_RUNS);
+}
+
+/**
+ * @return the baseline ns/op for @param name in @param path, or a negative value if not present
+ */
+static double baseline_for(const char *path, const char *name)
+{
+    char line_name[BENCH_NAME_LEN];
+    double value;
+    double found = -1.0;
+    FILE *f = fopen(path, "r");
+
+    if (!f) {
+        return -1.0;
+    }
+    while (fscanf(f, "%63s %lf", line_name, &value) == 2) {
+        if (strcmp(line_name, name) == 0) {
+            found = value;
+        }
+    }
+    fclose(f);
+    return found;
+}
+
+static bool regressed(double ns_per_op, double base, double threshold)
+{
+    return base > 0 && (ns_per_op - base) * 100.0 / base > threshold;
+}
+
+static bool write_baseline(const char *path, size_t count)
+{
+    FILE *f = fopen(path, "w");
+    size_t i;
+
+    if (!f) {
+        perror(path);
+        return false;
+    }
+    for (i = 0; i < count; i++) {
+        fprintf(f, "%s %.3f\n", results[i].name, results[i].ns_per_op);
+    }
+    fclose(f);
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *baseline = NULL;
+    double threshold = BENCH_DEFAULT_THRESHOLD;
+    bool update = false;
+    size_t ncases = sizeof(cases) / sizeof(cases[0]);
+    int regressions = 0;
+    size_t i;
+
+    for (i = 1; i < (size_t)argc; i++) {
+        if (strcmp(argv[i], "--baseline") == 0 && i + 1 < (size_t)argc) {
+            baseline = argv[++i];
+        } else if (strcmp(argv[i], "--threshold") == 0 && i + 1 < (size_t)argc) {
+            threshold = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--update-baseline") == 0) {
+            update = true;
+        } else {
+            fprintf(stderr, "Usage: %s [--baseline <file>] [--threshold <percent>] [--update-baseline]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    perf_open();
+    if (update && !baseline) {
+        fprintf(stderr, "--update-baseline requires --baseline\n");
+        return 2;
+    }
+
+    printf("%-36s %10s %10s %12s %10s %8s\n", "case", "ns/op", "entries/op", "misses/op", "baseline", "change");
+    for (i = 0; i < ncases; i++) {
+        struct bench_result *r = &results[i];
+        char misses[16] = "n/a";
+        char base_str[16] = "-";
+        char change[16] = "-";
+        double base;
+        int retry;
+
+        run_case(&cases[i], r);
+        base = (baseline && !update) ? baseline_for(baseline, r->name) : -1.0;
+        for (retry = 0; retry < BENCH_RETRIES && regressed(r->ns_per_op, base, threshold); retry++) {
+            struct bench_result again;
+            run_case(&cases[i], &again);
+            if (again.ns_per_op < r->ns_per_op) {
+                *r = again;
+            }
+        }
+
+        if (r->cache_misses_per_op >= 0) {
+            snprintf(misses, sizeof(misses), "%.4f", r->cache_misses_per_op);
+        }
+        if (base > 0) {
+            snprintf(base_str, sizeof(base_str), "%.2f", base);
+            snprintf(change, sizeof(change), "%+.1f%%", (r->ns_per_op - base) * 100.0 / base);
+        }
+        if (regressed(r->ns_per_op, base, threshold)) {
+            regressions++;
+        }
+        printf("%-36s %10.2f %10.2f %12s %10s %8s%s\n", r->name, r->ns_per_op, r->entries_per_op,
+                misses, base_str, change, regressed(r->ns_per_op, base, threshold) ? "  REGRESSION" : "");
+    }
+
+    if (update) {
+        return write_baseline(baseline, ncases) ? 0 : 1;
+    }
+    if (regressions) {
+        printf("%d case(s) regressed by more than %.1f%%\n", regressions, threshold);
+        return 1;
+    }
+    return 0;
+}
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE // pipe2()
 #include "systemcalls.h"
 
 /**
@@ -6,6 +7,7 @@
  *   successfully using the system() call, false if an error occurred,
  *   either in invocation of the system() call, or if a non-zero return
  *   value was returned by the command issued in @param cmd.
+ *   This goes through /bin/sh so @param cmd may use shell syntax, use do_exec() to avoid the shell.
 */
 bool do_system(const char *cmd)
 {
@@ -16,6 +18,98 @@ bool do_system(const char *cmd)
     return true;
 }
 
+/**
+* waitid() id type for a pidfd, not named by C libraries older than glibc 2.36
+*/
+#define EXEC_P_PIDFD ((idtype_t)3)
+
+/**
+* Bytes read from a capture pipe per read() call, and the initial size of a capture buffer
+*/
+#define CAPTURE_CHUNK 4096
+
+extern char **environ;
+
+struct running_child {
+    pid_t pid;
+    /**
+     * A pidfd for pid, or -1 if one couldn't be opened
+     */
+    int pidfd;
+    /**
+     * Index of the command in the array passed to do_exec_many()
+     */
+    size_t index;
+};
+
+static int exec_pidfd_open(pid_t pid)
+{
+#ifdef SYS_pidfd_open
+    return syscall(SYS_pidfd_open, pid, 0);
+#else
+    (void)pid;
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+/**
+* Start @param argv with posix_spawn(), which clones without copying the parent's page tables,
+* with standard output sent to @param outputfile when it is not NULL
+* @return 0 on success or an errno value, including when argv[0] could not be executed
+*/
+static int spawn_command(pid_t *pid, char *const argv[], const char *outputfile)
+{
+    posix_spawn_file_actions_t actions;
+    int ret;
+
+    if (!outputfile) {
+        return posix_spawn(pid, argv[0], NULL, NULL, argv, environ);
+    }
+
+    ret = posix_spawn_file_actions_init(&actions);
+    if (ret != 0) {
+        return ret;
+    }
+    ret = posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, outputfile,
+                                           O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (ret == 0) {
+        ret = posix_spawn(pid, argv[0], &actions, NULL, argv, environ);
+    }
+    posix_spawn_file_actions_destroy(&actions);
+    return ret;
+}
+
+/**
+* @return the exit status of child @param pid, or -1 if it was killed by a signal or could not
+* be waited for
+*/
+static int wait_child(pid_t pid)
+{
+    int status;
+
+    while (waitpid(pid, &status, 0) == -1) {
+        if (errno != EINTR) {
+            return -1;
+        }
+    }
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+/**
+* Run @param argv to completion, see spawn_command()
+* @return the exit status of the command, or -1 if it could not be started or was killed by a signal
+*/
+static int run_command(char *const argv[], const char *outputfile)
+{
+    pid_t pid;
+
+    if (spawn_command(&pid, argv, outputfile) != 0) {
+        return -1;
+    }
+    return wait_child(pid);
+}
+
 /**
 * @param count -The numbers of variables passed to the function. The variables are command to execute.
 *   followed by arguments to pass to the command
@@ -25,8 +119,8 @@ bool do_system(const char *cmd)
 *   The first is always the full path to the command to execute with execv()
 *   The remaining arguments are a list of arguments to pass to the command in execv()
 * @return true if the command @param ... with arguments @param arguments were executed successfully
-*   using the execv() call, false if an error occurred, either in invocation of the
-*   fork, waitpid, or execv() command, or if a non-zero return value was returned
+*   using posix_spawn(), false if an error occurred, either in invocation of the
+*   posix_spawn or waitpid, or in executing the command, or if a non-zero return value was returned
 *   by the command issued in @param arguments with the specified arguments.
 */
 
@@ -41,22 +135,9 @@ bool do_exec(int count, ...)
         command[i] = va_arg(args, char *);
     }
     command[count] = NULL;
-    pid_t pid = fork();
-    if (pid == -1) {
-        va_end(args);
-        return false;
-    } 
-    else if (pid == 0) {
-        execv(command[0], command);
-        exit(EXIT_FAILURE);
-    } 
-    int status;
-    if (waitpid(pid, &status, 0) == -1 || WEXITSTATUS(status)) {
-        va_end(args);
-        return false;
-    }
     va_end(args);
-    return true;
+
+    return run_command(command, NULL) == 0;
 }
 
 /**
@@ -75,29 +156,337 @@ bool do_exec_redirect(const char *outputfile, int count, ...)
         command[i] = va_arg(args, char *);
     }
     command[count] = NULL;
-    pid_t pid = fork();
-    if (pid == -1) {
-        perror("fork");
-        va_end(args);
+    va_end(args);
+
+    return run_command(command, outputfile) == 0;
+}
+
+/**
+* Remove entry @param i of the @param nrunning children in @param running and @param pfd,
+* recording @param status for its command
+*/
+static void finish_child(struct exec_cmd *cmds, struct running_child *running, struct pollfd *pfd,
+                         size_t *nrunning, size_t i, int status)
+{
+    cmds[running[i].index].status = status;
+    if (running[i].pidfd >= 0) {
+        close(running[i].pidfd);
+    }
+    (*nrunning)--;
+    running[i] = running[*nrunning];
+    pfd[i] = pfd[*nrunning];
+}
+
+/**
+* Wait for at least one of the @param nrunning children in @param running to exit.
+* Children with a pidfd are waited for together with poll(), the first child without one
+* (pidfd_open() is not available before Linux 5.3) is waited for with waitpid().
+*/
+static void reap_children(struct exec_cmd *cmds, struct running_child *running, struct pollfd *pfd,
+                          size_t *nrunning)
+{
+    size_t i;
+
+    for (i = 0; i < *nrunning; i++) {
+        if (running[i].pidfd < 0) {
+            finish_child(cmds, running, pfd, nrunning, i, wait_child(running[i].pid));
+            return;
+        }
+    }
+
+    if (poll(pfd, *nrunning, -1) == -1) {
+        if (errno != EINTR) {
+            /* Not expected with valid pidfds, fall back to waiting for the oldest child */
+            finish_child(cmds, running, pfd, nrunning, 0, wait_child(running[0].pid));
+        }
+        return;
+    }
+
+    i = *nrunning;
+    while (i-- > 0) {
+        siginfo_t info;
+        int status;
+
+        if (!pfd[i].revents) {
+            continue;
+        }
+        memset(&info, 0, sizeof(info));
+        if (waitid(EXEC_P_PIDFD, running[i].pidfd, &info, WEXITED) == 0) {
+            status = info.si_code == CLD_EXITED ? info.si_status : -1;
+        } else {
+            /* Linux 5.3 has pidfd_open() but not waitid(P_PIDFD) */
+            status = wait_child(running[i].pid);
+        }
+        finish_child(cmds, running, pfd, nrunning, i, status);
+    }
+}
+
+/**
+* Run the @param count commands in @param cmds with at most @param max_parallel of them running
+* at once, or one per online CPU when @param max_parallel is 0.  Commands are started in order
+* as earlier ones exit, so the ones that finish first free their slot for the next.
+* Each command is started in the same way as do_exec(), or do_exec_redirect() when its
+* outputfile is set, and its status member is set to its exit status, or -1 if it could not
+* be started or was killed by a signal.
+* @return true if every command was started and exited with status 0
+*/
+bool do_exec_many(struct exec_cmd *cmds, size_t count, size_t max_parallel)
+{
+    struct running_child *running;
+    struct pollfd *pfd;
+    size_t next = 0;
+    size_t nrunning = 0;
+    size_t i;
+    bool success = true;
+
+    if (max_parallel == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        max_parallel = cpus > 0 ? (size_t)cpus : 1;
+    }
+    if (max_parallel > count) {
+        max_parallel = count ? count : 1;
+    }
+    running = calloc(max_parallel, sizeof(*running));
+    pfd = calloc(max_parallel, sizeof(*pfd));
+    if (!running || !pfd) {
+        free(running);
+        free(pfd);
+        for (i = 0; i < count; i++) {
+            cmds[i].status = -1;
+        }
         return false;
-    } else if (pid == 0) {
-        int fd = open(outputfile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-        if (fd == -1) {
-            exit(EXIT_FAILURE);
+    }
+
+    while (next < count || nrunning) {
+        while (nrunning < max_parallel && next < count) {
+            pid_t pid;
+
+            if (spawn_command(&pid, cmds[next].argv, cmds[next].outputfile) != 0) {
+                cmds[next++].status = -1;
+                continue;
+            }
+            running[nrunning].pid = pid;
+            running[nrunning].pidfd = exec_pidfd_open(pid);
+            running[nrunning].index = next++;
+            pfd[nrunning].fd = running[nrunning].pidfd;
+            pfd[nrunning].events = POLLIN;
+            pfd[nrunning].revents = 0;
+            nrunning++;
         }
-        if (dup2(fd, STDOUT_FILENO) < 0) {
-            close(fd);
-            exit(EXIT_FAILURE);
+        if (nrunning) {
+            reap_children(cmds, running, pfd, &nrunning);
         }
-        close(fd);
-        execv(command[0], command);
-        exit(EXIT_FAILURE);
     }
-    int status;
-    if (waitpid(pid, &status, 0) == -1 || WEXITSTATUS(status)) {
-        va_end(args);
+
+    for (i = 0; i < count; i++) {
+        if (cmds[i].status != 0) {
+            success = false;
+        }
+    }
+    free(running);
+    free(pfd);
+    return success;
+}
+
+/**
+* One stream collected by do_exec_capture()
+*/
+struct capture_stream {
+    int fd;
+    char **buf;
+    size_t *len;
+    size_t cap;
+};
+
+/**
+* Read what is available on @param stream into its buffer, keeping at most @param max_bytes
+* (unlimited when 0) and discarding the rest so the child never blocks on a full pipe.
+* Closes the pipe and sets fd to -1 at end of file.
+* @return true if output had to be discarded
+*/
+static bool capture_read(struct capture_stream *stream, size_t max_bytes)
+{
+    char discard[CAPTURE_CHUNK];
+    size_t room = CAPTURE_CHUNK;
+    char *dest = discard;
+    ssize_t n;
+
+    if (max_bytes == 0 || *stream->len < max_bytes) {
+        if (*stream->len + CAPTURE_CHUNK + 1 > stream->cap) {
+            size_t cap = stream->cap ? stream->cap * 2 : CAPTURE_CHUNK;
+            char *tmp;
+            while (cap < *stream->len + CAPTURE_CHUNK + 1) {
+                cap *= 2;
+            }
+            if (max_bytes && cap > max_bytes + 1) {
+                cap = max_bytes + 1;
+            }
+            tmp = realloc(*stream->buf, cap);
+            if (tmp) {
+                *stream->buf = tmp;
+                stream->cap = cap;
+            }
+        }
+        if (*stream->len + 1 < stream->cap) {
+            room = stream->cap - *stream->len - 1;
+            dest = *stream->buf + *stream->len;
+        }
+    }
+
+    n = read(stream->fd, dest, room);
+    if (n == 0 || (n < 0 && errno != EINTR && errno != EAGAIN)) {
+        close(stream->fd);
+        stream->fd = -1;
         return false;
     }
+    if (n < 0) {
+        return false;
+    }
+    if (dest == discard) {
+        return true;
+    }
+    *stream->len += n;
+    (*stream->buf)[*stream->len] = '\0';
+    return false;
+}
+
+/**
+* Run a command as do_exec() does, collecting its standard output and standard error in memory.
+* @param capture - Filled with the output, release it with exec_capture_free().  out and err are
+*   NUL terminated when not NULL.
+* @param max_bytes - The most bytes kept from each stream, 0 for no limit.  Output beyond this is
+*   read and discarded and capture->truncated is set.
+* @param timeout_ms - Kill the command with SIGKILL if it runs longer than this, or never if
+*   negative.  capture->timed_out is set when this happens.
+* The output is collected until both streams are closed, so a command which leaves a background
+* process holding them open runs into the timeout.
+* @return true if the command was executed and exited with status 0 before the timeout
+*/
+bool do_exec_capture(struct exec_capture *capture, size_t max_bytes, int timeout_ms, int count, ...)
+{
+    va_list args;
+    va_start(args, count);
+    char * command[count+1];
+    int i;
+    for(i=0; i<count; i++)
+    {
+        command[i] = va_arg(args, char *);
+    }
+    command[count] = NULL;
     va_end(args);
-    return true;
+
+    struct capture_stream stream[2] = {
+        { .fd = -1, .buf = &capture->out, .len = &capture->out_len },
+        { .fd = -1, .buf = &capture->err, .len = &capture->err_len },
+    };
+    posix_spawn_file_actions_t actions;
+    int out_pipe[2] = { -1, -1 };
+    int err_pipe[2] = { -1, -1 };
+    struct timespec deadline;
+    pid_t pid;
+    int ret;
+
+    memset(capture, 0, sizeof(*capture));
+    capture->status = -1;
+
+    /* O_CLOEXEC keeps the pipes out of commands spawned concurrently by other threads */
+    if (pipe2(out_pipe, O_CLOEXEC) == -1 || pipe2(err_pipe, O_CLOEXEC) == -1) {
+        goto close_pipes;
+    }
+    if (posix_spawn_file_actions_init(&actions) != 0) {
+        goto close_pipes;
+    }
+    /* dup2() clears O_CLOEXEC on the child's standard output and error */
+    ret = posix_spawn_file_actions_adddup2(&actions, out_pipe[1], STDOUT_FILENO);
+    if (ret == 0) {
+        ret = posix_spawn_file_actions_adddup2(&actions, err_pipe[1], STDERR_FILENO);
+    }
+    if (ret == 0) {
+        ret = posix_spawn(&pid, command[0], &actions, NULL, command, environ);
+    }
+    posix_spawn_file_actions_destroy(&actions);
+    if (ret != 0) {
+        goto close_pipes;
+    }
+    close(out_pipe[1]);
+    close(err_pipe[1]);
+    stream[0].fd = out_pipe[0];
+    stream[1].fd = err_pipe[0];
+
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+
+    while (stream[0].fd >= 0 || stream[1].fd >= 0) {
+        struct pollfd pfd[2];
+        int wait_ms = -1;
+
+        if (timeout_ms >= 0) {
+            struct timespec now;
+            long long left;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            left = (deadline.tv_sec - now.tv_sec) * 1000LL + (deadline.tv_nsec - now.tv_nsec) / 1000000;
+            if (left <= 0) {
+                kill(pid, SIGKILL);
+                capture->timed_out = true;
+                break;
+            }
+            wait_ms = left > INT_MAX ? INT_MAX : (int)left;
+        }
+
+        for (i = 0; i < 2; i++) {
+            pfd[i].fd = stream[i].fd;
+            pfd[i].events = POLLIN;
+            pfd[i].revents = 0;
+        }
+        if (poll(pfd, 2, wait_ms) == -1 && errno != EINTR) {
+            kill(pid, SIGKILL);
+            break;
+        }
+        for (i = 0; i < 2; i++) {
+            if (stream[i].fd >= 0 && pfd[i].revents && capture_read(&stream[i], max_bytes)) {
+                capture->truncated = true;
+            }
+        }
+    }
+
+    for (i = 0; i < 2; i++) {
+        if (*stream[i].len == 0) {
+            free(*stream[i].buf);
+            *stream[i].buf = NULL;
+        }
+    }
+    capture->status = wait_child(pid);
+    if (capture->timed_out) {
+        capture->status = -1;
+    }
+    out_pipe[0] = stream[0].fd;
+    err_pipe[0] = stream[1].fd;
+    out_pipe[1] = err_pipe[1] = -1;
+
+close_pipes:
+    for (i = 0; i < 2; i++) {
+        if (out_pipe[i] >= 0) {
+            close(out_pipe[i]);
+        }
+        if (err_pipe[i] >= 0) {
+            close(err_pipe[i]);
+        }
+    }
+    return capture->status == 0;
+}
+
+/**
+* Release the output collected by do_exec_capture()
+*/
+void exec_capture_free(struct exec_capture *capture)
+{
+    free(capture->out);
+    free(capture->err);
+    capture->out = capture->err = NULL;
+    capture->out_len = capture->err_len = 0;
 }
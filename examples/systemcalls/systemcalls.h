@@ -6,6 +6,14 @@
 #include <sys/wait.h>
 #include <sys/types.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <time.h>
+#include <errno.h>
+#include <string.h>
+#include <poll.h>
+#include <spawn.h>
+#include <sys/syscall.h>
 
 
 bool do_system(const char *command);
@@ -13,3 +21,55 @@ bool do_system(const char *command);
 bool do_exec(int count, ...);
 
 bool do_exec_redirect(const char *outputfile, int count, ...);
+
+/**
+* A command for do_exec_many()
+*/
+struct exec_cmd {
+    /**
+     * The full path to the command followed by its arguments, terminated by NULL, as for execv()
+     */
+    char *const *argv;
+    /**
+     * The file to write the command's standard output to, or NULL to inherit it
+     */
+    const char *outputfile;
+    /**
+     * Set to the exit status of the command, or -1 if it could not be started or was killed
+     */
+    int status;
+};
+
+bool do_exec_many(struct exec_cmd *cmds, size_t count, size_t max_parallel);
+
+/**
+* Output collected by do_exec_capture()
+*/
+struct exec_capture {
+    /**
+     * Standard output of the command, NUL terminated, or NULL if it wrote nothing
+     */
+    char *out;
+    size_t out_len;
+    /**
+     * Standard error of the command, NUL terminated, or NULL if it wrote nothing
+     */
+    char *err;
+    size_t err_len;
+    /**
+     * Set when output beyond the size limit was discarded
+     */
+    bool truncated;
+    /**
+     * Set when the command was killed because it ran past the timeout
+     */
+    bool timed_out;
+    /**
+     * The exit status of the command, or -1 if it could not be started, was killed or timed out
+     */
+    int status;
+};
+
+bool do_exec_capture(struct exec_capture *capture, size_t max_bytes, int timeout_ms, int count, ...);
+
+void exec_capture_free(struct exec_capture *capture);
@@ -0,0 +1,101 @@
+/**
+ * Command line front end for locklab.c
+ *
+ * Usage: locklab [-l lock|all] [-t threads] [-H hold_ns] [-T think_ns] [-d duration_ms]
+ *                [-r read_percent] [-v]
+ *
+ * Lock types: mutex, adaptive, spinlock, ticket, rwlock, futex.  -v adds the acquisition
+ * latency histogram of each lock.  To model the data file lock in aesdsocket, use a hold time
+ * close to one write and read back of the file and a think time close to one recv().
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "locklab.h"
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-l lock|all] [-t threads] [-H hold_ns] [-T think_ns] [-d duration_ms]"
+            " [-r read_percent] [-v]\n", prog);
+}
+
+static void print_histogram(const struct locklab_result *result)
+{
+    int i;
+
+    for (i = 0; i < LOCKLAB_LATENCY_BUCKETS; i++) {
+        if (!result->latency[i]) {
+            continue;
+        }
+        printf("    < %-12llu %12llu\n", 1ULL << i, (unsigned long long)result->latency[i]);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    struct locklab_config config = {
+        .threads = 4,
+        .hold_ns = 1000,
+        .think_ns = 1000,
+        .duration_ms = 1000,
+        .read_percent = 80,
+    };
+    struct locklab_result result;
+    enum locklab_type type;
+    int first = 0, last = LOCKLAB_TYPES - 1;
+    bool verbose = false, ok = true;
+    int opt, i;
+
+    while ((opt = getopt(argc, argv, "l:t:H:T:d:r:v")) != -1) {
+        switch (opt) {
+        case 'l':
+            if (strcmp(optarg, "all") == 0) {
+                break;
+            }
+            if (!locklab_parse_type(optarg, &type)) {
+                usage(argv[0]);
+                return 2;
+            }
+            first = last = type;
+            break;
+        case 't': config.threads = atoi(optarg); break;
+        case 'H': config.hold_ns = strtoul(optarg, NULL, 0); break;
+        case 'T': config.think_ns = strtoul(optarg, NULL, 0); break;
+        case 'd': config.duration_ms = strtoul(optarg, NULL, 0); break;
+        case 'r': config.read_percent = atoi(optarg); break;
+        case 'v': verbose = true; break;
+        default:
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    if (config.threads < 1 || config.duration_ms == 0) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    printf("%d threads, hold %uns, think %uns, %ums per lock\n", config.threads,
+           config.hold_ns, config.think_ns, config.duration_ms);
+    printf("%-10s %12s %9s %12s %12s %10s %10s %12s\n", "lock", "ops/s", "fairness",
+           "min_ops", "max_ops", "p50_ns", "p99_ns", "max_ns");
+    for (i = first; i <= last; i++) {
+        config.type = (enum locklab_type)i;
+        if (!locklab_run(&config, &result)) {
+            fprintf(stderr, "%s: could not run\n", locklab_type_name(config.type));
+            ok = false;
+            continue;
+        }
+        printf("%-10s %12.0f %9.3f %12llu %12llu %10llu %10llu %12llu%s\n",
+               locklab_type_name(config.type), result.ops_per_sec, result.fairness,
+               (unsigned long long)result.min_thread_ops, (unsigned long long)result.max_thread_ops,
+               (unsigned long long)result.p50_ns, (unsigned long long)result.p99_ns,
+               (unsigned long long)result.max_ns,
+               result.mutual_exclusion_ok ? "" : "  MUTUAL EXCLUSION VIOLATED");
+        if (verbose) {
+            print_histogram(&result);
+        }
+        ok = ok && result.mutual_exclusion_ok;
+    }
+    return ok ? 0 : 1;
+}
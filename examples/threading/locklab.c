@@ -0,0 +1,442 @@
+#define _GNU_SOURCE // PTHREAD_MUTEX_ADAPTIVE_NP
+#include "locklab.h"
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+/**
+ * Spins on a busy lock before yielding the CPU, so spinning locks still make progress when
+ * the holder has been preempted on a machine with fewer CPUs than threads
+ */
+#define LOCKLAB_SPINS_BEFORE_YIELD 1000
+
+static const char *const type_names[LOCKLAB_TYPES] = {
+    [LOCKLAB_MUTEX] = "mutex",
+    [LOCKLAB_ADAPTIVE] = "adaptive",
+    [LOCKLAB_SPINLOCK] = "spinlock",
+    [LOCKLAB_TICKET] = "ticket",
+    [LOCKLAB_RWLOCK] = "rwlock",
+    [LOCKLAB_FUTEX] = "futex",
+};
+
+struct ticket_lock {
+    atomic_uint next;
+    atomic_uint serving;
+};
+
+struct lab_lock {
+    enum locklab_type type;
+    union {
+        pthread_mutex_t mutex;
+        pthread_spinlock_t spin;
+        struct ticket_lock ticket;
+        pthread_rwlock_t rwlock;
+        /* 0 unlocked, 1 locked, 2 locked with waiters */
+        atomic_int futex;
+    } u;
+};
+
+struct lab_shared {
+    const struct locklab_config *config;
+    struct lab_lock lock;
+    /**
+     * Set once every thread has been created, so they all start contending together
+     */
+    atomic_bool go;
+    atomic_bool stop;
+    /**
+     * Updated without atomics inside exclusive critical sections, a lock which does not provide
+     * mutual exclusion loses increments
+     */
+    uint64_t protected_counter;
+    /**
+     * Number of threads inside an exclusive and a shared critical section.  The counts are
+     * updated and checked with sequentially consistent atomics, so of a reader and a writer
+     * entering at the same time at least one sees the other.
+     */
+    atomic_int inside;
+    atomic_int readers;
+    atomic_bool overlap;
+};
+
+struct lab_thread {
+    pthread_t thread;
+    struct lab_shared *shared;
+    unsigned int seed;
+    uint64_t ops;
+    uint64_t exclusive_ops;
+    uint64_t latency[LOCKLAB_LATENCY_BUCKETS];
+    uint64_t max_ns;
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void busy_ns(unsigned int ns)
+{
+    uint64_t end;
+
+    if (ns == 0) {
+        return;
+    }
+    end = now_ns() + ns;
+    while (now_ns() < end)
+        ;
+}
+
+static inline void cpu_relax(unsigned int *spins)
+{
+    if (++*spins % LOCKLAB_SPINS_BEFORE_YIELD == 0) {
+        sched_yield();
+        return;
+    }
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+static long futex(atomic_int *uaddr, int op, int val)
+{
+    return syscall(SYS_futex, uaddr, op, val, NULL, NULL, 0);
+}
+
+/**
+ * The mutex from Ulrich Drepper's "Futexes Are Tricky", which only enters the kernel
+ * when the lock is contended
+ */
+static void futex_lock(atomic_int *f)
+{
+    int c = 0;
+    unsigned int spins;
+
+    if (atomic_compare_exchange_strong(f, &c, 1)) {
+        return;
+    }
+    /* Spin briefly in case the holder is about to release */
+    for (spins = 0; spins < 100; spins++) {
+        c = 0;
+        if (atomic_load_explicit(f, memory_order_relaxed) == 0 && atomic_compare_exchange_strong(f, &c, 1)) {
+            return;
+        }
+    }
+    if (c != 2) {
+        c = atomic_exchange(f, 2);
+    }
+    while (c != 0) {
+        futex(f, FUTEX_WAIT_PRIVATE, 2);
+        c = atomic_exchange(f, 2);
+    }
+}
+
+static void futex_unlock(atomic_int *f)
+{
+    if (atomic_fetch_sub(f, 1) != 1) {
+        atomic_store(f, 0);
+        futex(f, FUTEX_WAKE_PRIVATE, 1);
+    }
+}
+
+static bool lab_lock_init(struct lab_lock *lock, enum locklab_type type)
+{
+    pthread_mutexattr_t attr;
+    bool ok = true;
+
+    memset(lock, 0, sizeof(*lock));
+    lock->type = type;
+    switch (type) {
+    case LOCKLAB_MUTEX:
+        ok = pthread_mutex_init(&lock->u.mutex, NULL) == 0;
+        break;
+    case LOCKLAB_ADAPTIVE:
+        pthread_mutexattr_init(&attr);
+#ifdef PTHREAD_MUTEX_ADAPTIVE_NP
+        pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_ADAPTIVE_NP);
+#endif
+        ok = pthread_mutex_init(&lock->u.mutex, &attr) == 0;
+        pthread_mutexattr_destroy(&attr);
+        break;
+    case LOCKLAB_SPINLOCK:
+        ok = pthread_spin_init(&lock->u.spin, PTHREAD_PROCESS_PRIVATE) == 0;
+        break;
+    case LOCKLAB_TICKET:
+        atomic_init(&lock->u.ticket.next, 0);
+        atomic_init(&lock->u.ticket.serving, 0);
+        break;
+    case LOCKLAB_RWLOCK:
+        ok = pthread_rwlock_init(&lock->u.rwlock, NULL) == 0;
+        break;
+    case LOCKLAB_FUTEX:
+        atomic_init(&lock->u.futex, 0);
+        break;
+    default:
+        ok = false;
+        break;
+    }
+    return ok;
+}
+
+static void lab_lock_destroy(struct lab_lock *lock)
+{
+    switch (lock->type) {
+    case LOCKLAB_MUTEX:
+    case LOCKLAB_ADAPTIVE:
+        pthread_mutex_destroy(&lock->u.mutex);
+        break;
+    case LOCKLAB_SPINLOCK:
+        pthread_spin_destroy(&lock->u.spin);
+        break;
+    case LOCKLAB_RWLOCK:
+        pthread_rwlock_destroy(&lock->u.rwlock);
+        break;
+    default:
+        break;
+    }
+}
+
+static void lab_lock_acquire(struct lab_lock *lock, bool shared)
+{
+    unsigned int ticket;
+    unsigned int spins = 0;
+
+    switch (lock->type) {
+    case LOCKLAB_MUTEX:
+    case LOCKLAB_ADAPTIVE:
+        pthread_mutex_lock(&lock->u.mutex);
+        break;
+    case LOCKLAB_SPINLOCK:
+        /* pthread_spin_lock() never yields, trylock keeps the run bounded on a single CPU */
+        while (pthread_spin_trylock(&lock->u.spin) != 0) {
+            cpu_relax(&spins);
+        }
+        break;
+    case LOCKLAB_TICKET:
+        ticket = atomic_fetch_add_explicit(&lock->u.ticket.next, 1, memory_order_relaxed);
+        while (atomic_load_explicit(&lock->u.ticket.serving, memory_order_acquire) != ticket) {
+            cpu_relax(&spins);
+        }
+        break;
+    case LOCKLAB_RWLOCK:
+        if (shared) {
+            pthread_rwlock_rdlock(&lock->u.rwlock);
+        } else {
+            pthread_rwlock_wrlock(&lock->u.rwlock);
+        }
+        break;
+    case LOCKLAB_FUTEX:
+        futex_lock(&lock->u.futex);
+        break;
+    default:
+        break;
+    }
+}
+
+static void lab_lock_release(struct lab_lock *lock)
+{
+    switch (lock->type) {
+    case LOCKLAB_MUTEX:
+    case LOCKLAB_ADAPTIVE:
+        pthread_mutex_unlock(&lock->u.mutex);
+        break;
+    case LOCKLAB_SPINLOCK:
+        pthread_spin_unlock(&lock->u.spin);
+        break;
+    case LOCKLAB_TICKET:
+        atomic_store_explicit(&lock->u.ticket.serving,
+                atomic_load_explicit(&lock->u.ticket.serving, memory_order_relaxed) + 1,
+                memory_order_release);
+        break;
+    case LOCKLAB_RWLOCK:
+        pthread_rwlock_unlock(&lock->u.rwlock);
+        break;
+    case LOCKLAB_FUTEX:
+        futex_unlock(&lock->u.futex);
+        break;
+    default:
+        break;
+    }
+}
+
+static void *lab_thread_func(void *arg)
+{
+    struct lab_thread *t = arg;
+    struct lab_shared *shared = t->shared;
+    const struct locklab_config *config = shared->config;
+
+    while (!atomic_load(&shared->go)) {
+        sched_yield();
+    }
+    while (!atomic_load_explicit(&shared->stop, memory_order_relaxed)) {
+        bool is_shared = config->type == LOCKLAB_RWLOCK &&
+                         (int)(rand_r(&t->seed) % 100) < config->read_percent;
+        uint64_t start = now_ns();
+        uint64_t waited;
+        int bucket;
+
+        lab_lock_acquire(&shared->lock, is_shared);
+        waited = now_ns() - start;
+
+        if (is_shared) {
+            atomic_fetch_add(&shared->readers, 1);
+            if (atomic_load(&shared->inside) != 0) {
+                atomic_store(&shared->overlap, true);
+            }
+            busy_ns(config->hold_ns);
+            atomic_fetch_sub(&shared->readers, 1);
+        } else {
+            if (atomic_fetch_add(&shared->inside, 1) != 0 || atomic_load(&shared->readers) != 0) {
+                atomic_store(&shared->overlap, true);
+            }
+            shared->protected_counter++;
+            busy_ns(config->hold_ns);
+            atomic_fetch_sub(&shared->inside, 1);
+            t->exclusive_ops++;
+        }
+        lab_lock_release(&shared->lock);
+
+        bucket = waited ? 64 - __builtin_clzll(waited) : 0;
+        if (bucket >= LOCKLAB_LATENCY_BUCKETS) {
+            bucket = LOCKLAB_LATENCY_BUCKETS - 1;
+        }
+        t->latency[bucket]++;
+        if (waited > t->max_ns) {
+            t->max_ns = waited;
+        }
+        t->ops++;
+
+        busy_ns(config->think_ns);
+    }
+    return NULL;
+}
+
+/**
+ * @return the upper bound of the bucket holding the @param percent percentile of @param latency
+ */
+static uint64_t latency_percentile(const uint64_t *latency, uint64_t total, double percent)
+{
+    uint64_t target = (uint64_t)(total * percent / 100.0);
+    uint64_t seen = 0;
+    int i;
+
+    for (i = 0; i < LOCKLAB_LATENCY_BUCKETS; i++) {
+        seen += latency[i];
+        if (seen > target) {
+            return 1ULL << i;
+        }
+    }
+    return 1ULL << (LOCKLAB_LATENCY_BUCKETS - 1);
+}
+
+const char *locklab_type_name(enum locklab_type type)
+{
+    return type < LOCKLAB_TYPES ? type_names[type] : "unknown";
+}
+
+bool locklab_parse_type(const char *name, enum locklab_type *type)
+{
+    int i;
+
+    for (i = 0; i < LOCKLAB_TYPES; i++) {
+        if (strcmp(name, type_names[i]) == 0) {
+            *type = i;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool locklab_run(const struct locklab_config *config, struct locklab_result *result)
+{
+    struct lab_shared shared;
+    struct lab_thread *threads;
+    struct timespec duration;
+    uint64_t start, elapsed, exclusive_ops = 0;
+    double sum = 0, sum_sq = 0;
+    int i, j, started;
+
+    memset(result, 0, sizeof(*result));
+    if (config->threads < 1) {
+        return false;
+    }
+    threads = calloc(config->threads, sizeof(*threads));
+    if (!threads) {
+        return false;
+    }
+
+    memset(&shared, 0, sizeof(shared));
+    shared.config = config;
+    if (!lab_lock_init(&shared.lock, config->type)) {
+        free(threads);
+        return false;
+    }
+
+    for (started = 0; started < config->threads; started++) {
+        threads[started].shared = &shared;
+        threads[started].seed = started + 1;
+        if (pthread_create(&threads[started].thread, NULL, lab_thread_func, &threads[started]) != 0) {
+            break;
+        }
+    }
+    if (started < config->threads) {
+        atomic_store(&shared.stop, true);
+        atomic_store(&shared.go, true);
+        for (i = 0; i < started; i++) {
+            pthread_join(threads[i].thread, NULL);
+        }
+        lab_lock_destroy(&shared.lock);
+        free(threads);
+        return false;
+    }
+
+    atomic_store(&shared.go, true);
+    start = now_ns();
+    duration.tv_sec = config->duration_ms / 1000;
+    duration.tv_nsec = (config->duration_ms % 1000) * 1000000L;
+    while (nanosleep(&duration, &duration) == -1)
+        ;
+    atomic_store(&shared.stop, true);
+
+    for (i = 0; i < config->threads; i++) {
+        pthread_join(threads[i].thread, NULL);
+    }
+    elapsed = now_ns() - start;
+
+    result->min_thread_ops = UINT64_MAX;
+    for (i = 0; i < config->threads; i++) {
+        struct lab_thread *t = &threads[i];
+        result->total_ops += t->ops;
+        exclusive_ops += t->exclusive_ops;
+        sum += t->ops;
+        sum_sq += (double)t->ops * t->ops;
+        if (t->ops < result->min_thread_ops) {
+            result->min_thread_ops = t->ops;
+        }
+        if (t->ops > result->max_thread_ops) {
+            result->max_thread_ops = t->ops;
+        }
+        if (t->max_ns > result->max_ns) {
+            result->max_ns = t->max_ns;
+        }
+        for (j = 0; j < LOCKLAB_LATENCY_BUCKETS; j++) {
+            result->latency[j] += t->latency[j];
+        }
+    }
+    result->ops_per_sec = result->total_ops / (elapsed / 1e9);
+    result->fairness = sum_sq > 0 ? sum * sum / (config->threads * sum_sq) : 1.0;
+    result->p50_ns = latency_percentile(result->latency, result->total_ops, 50);
+    result->p99_ns = latency_percentile(result->latency, result->total_ops, 99);
+    result->mutual_exclusion_ok = !atomic_load(&shared.overlap) &&
+                                  shared.protected_counter == exclusive_ops;
+
+    lab_lock_destroy(&shared.lock);
+    free(threads);
+    return true;
+}
@@ -0,0 +1,83 @@
+#ifndef LOCKLAB_H
+#define LOCKLAB_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+
+/**
+ * A lock contention lab: N threads repeatedly take one shared lock, hold it for a while, release
+ * it and think before trying again, so the lock types below can be compared under the same load.
+ * Used to pick the lock protecting the data file in aesdsocket.
+ */
+
+enum locklab_type {
+    LOCKLAB_MUTEX,      /* pthread_mutex_t with default attributes */
+    LOCKLAB_ADAPTIVE,   /* pthread_mutex_t which spins briefly before sleeping, where available */
+    LOCKLAB_SPINLOCK,   /* pthread_spinlock_t */
+    LOCKLAB_TICKET,     /* FIFO ticket lock, spinning */
+    LOCKLAB_RWLOCK,     /* pthread_rwlock_t, see locklab_config.read_percent */
+    LOCKLAB_FUTEX,      /* three state futex mutex, spins briefly then sleeps in the kernel */
+    LOCKLAB_TYPES
+};
+
+/**
+ * Number of log2 buckets in the acquisition latency histogram, bucket i counts acquisitions
+ * which waited less than 2^i ns, the last bucket counts everything slower
+ */
+#define LOCKLAB_LATENCY_BUCKETS 32
+
+struct locklab_config {
+    enum locklab_type type;
+    int threads;
+    /**
+     * Time spent busy inside and outside the critical section on each iteration
+     */
+    unsigned int hold_ns;
+    unsigned int think_ns;
+    unsigned int duration_ms;
+    /**
+     * Percentage of acquisitions taken shared with LOCKLAB_RWLOCK, the others are exclusive.
+     * Ignored by the other lock types which are always exclusive.
+     */
+    int read_percent;
+};
+
+struct locklab_result {
+    uint64_t total_ops;
+    double ops_per_sec;
+    /**
+     * Jain's fairness index of the per thread operation counts, 1.0 when all threads
+     * completed the same number of operations and 1/threads when one thread did all of them
+     */
+    double fairness;
+    uint64_t min_thread_ops;
+    uint64_t max_thread_ops;
+    uint64_t latency[LOCKLAB_LATENCY_BUCKETS];
+    /**
+     * Upper bounds of the latency percentiles, from the histogram
+     */
+    uint64_t p50_ns;
+    uint64_t p99_ns;
+    uint64_t max_ns;
+    /**
+     * False if an exclusive critical section was seen to overlap another one, exclusive or
+     * shared
+     */
+    bool mutual_exclusion_ok;
+};
+
+const char *locklab_type_name(enum locklab_type type);
+
+/**
+ * @return true if @param name is the name of a lock type, which is stored in @param type
+ */
+bool locklab_parse_type(const char *name, enum locklab_type *type);
+
+/**
+ * Run the workload described by @param config and fill @param result
+ * @return true on success, false if the threads could not be started
+ */
+bool locklab_run(const struct locklab_config *config, struct locklab_result *result);
+
+#endif /* LOCKLAB_H */
@@ -53,10 +53,8 @@ fi
 #make clean
 #make
 
-for i in $( seq 1 $NUMFILES)
-do
-	writer "$WRITEDIR/${username}$i.txt" "$WRITESTR"
-done
+# Create ${username}1.txt to ${username}${NUMFILES}.txt from a single writer process
+writer --batch "$WRITEDIR" "${username}" .txt "$NUMFILES" "$WRITESTR"
 
 OUTPUTSTRING=$(finder.sh "$WRITEDIR" "$WRITESTR")
 echo "${OUTPUTSTRING}" > /tmp/assignment4-result.txt
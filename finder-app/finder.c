@@ -0,0 +1,386 @@
+/**
+ * finder: count the regular files below a directory and the lines in them matching a string,
+ * printing the same line as finder.sh:
+ *
+ *   The number of files are X and the number of matching lines are Y
+ *
+ * X is what "find <dir> -type f | wc -l" counts and Y what "grep -r <string> <dir> | wc -l"
+ * counts, found in a single walk of the tree.  Directories are shared out between threads with
+ * work stealing: each thread pushes the subdirectories it finds onto its own deque and pops
+ * from the same end, idle threads steal the oldest directory of another thread, which tends to
+ * be the root of a large subtree.  Files are mapped with mmap() and searched with memmem(), which
+ * skips through non matching data with the C library's vectorized routines, so matching lines
+ * are counted without splitting the file into lines first.
+ *
+ * As with grep, the string is a basic regular expression.  Strings without regular expression
+ * special characters, which is how finder-test.sh uses it, take the memmem() path.  Files
+ * containing a NUL byte are binary, for which GNU grep reports matches on standard error rather
+ * than as lines, so they add no lines.
+ *
+ * The number of threads defaults to the number of online CPUs and can be set with the
+ * FINDER_THREADS environment variable.
+ */
+#define _GNU_SOURCE // memmem()
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <regex.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#define FINDER_MAX_THREADS 64
+#define FINDER_DEQUE_INITIAL 64
+
+struct deque {
+    pthread_mutex_t lock;
+    char **path;
+    size_t cap;
+    /* Items are path[head] to path[tail - 1], the owner works at tail and thieves at head */
+    size_t head;
+    size_t tail;
+};
+
+struct worker {
+    pthread_t thread;
+    int index;
+    struct deque deque;
+    unsigned long long files;
+    unsigned long long lines;
+};
+
+static struct worker workers[FINDER_MAX_THREADS];
+static int nworkers;
+/**
+ * Directories pushed but not yet fully read, the walk is over when this drops to 0
+ */
+static atomic_long pending;
+
+static const char *search;
+static size_t search_len;
+static bool use_regex;
+/**
+ * Set when the search string is not a valid regular expression, for which grep finds nothing
+ */
+static bool match_nothing;
+static regex_t regex;
+
+static bool deque_push(struct deque *d, char *path)
+{
+    bool ok = true;
+
+    pthread_mutex_lock(&d->lock);
+    if (d->tail == d->cap) {
+        if (d->head > 0) {
+            memmove(d->path, d->path + d->head, (d->tail - d->head) * sizeof(*d->path));
+            d->tail -= d->head;
+            d->head = 0;
+        } else {
+            size_t cap = d->cap ? d->cap * 2 : FINDER_DEQUE_INITIAL;
+            char **tmp = realloc(d->path, cap * sizeof(*d->path));
+            if (tmp) {
+                d->path = tmp;
+                d->cap = cap;
+            } else {
+                ok = false;
+            }
+        }
+    }
+    if (ok) {
+        d->path[d->tail++] = path;
+    }
+    pthread_mutex_unlock(&d->lock);
+    return ok;
+}
+
+/**
+ * @return the newest directory pushed by the owner, or NULL if the deque is empty
+ */
+static char *deque_pop(struct deque *d)
+{
+    char *path = NULL;
+
+    pthread_mutex_lock(&d->lock);
+    if (d->tail > d->head) {
+        path = d->path[--d->tail];
+    }
+    pthread_mutex_unlock(&d->lock);
+    return path;
+}
+
+/**
+ * @return the oldest directory in the deque, or NULL if it is empty
+ */
+static char *deque_steal(struct deque *d)
+{
+    char *path = NULL;
+
+    if (pthread_mutex_trylock(&d->lock) != 0) {
+        return NULL;
+    }
+    if (d->tail > d->head) {
+        path = d->path[d->head++];
+    }
+    pthread_mutex_unlock(&d->lock);
+    return path;
+}
+
+/**
+ * @return true if the line from @param start to @param end (exclusive) matches the regex
+ */
+static bool regex_line_matches(const char *start, const char *end)
+{
+#ifdef REG_STARTEND
+    regmatch_t match = { .rm_so = 0, .rm_eo = end - start };
+    return regexec(&regex, start, 1, &match, REG_STARTEND) == 0;
+#else
+    char *line = strndup(start, end - start);
+    bool matched = line && regexec(&regex, line, 0, NULL, 0) == 0;
+    free(line);
+    return matched;
+#endif
+}
+
+/**
+ * @return the number of lines in @param size bytes at @param data which match the search string
+ */
+static unsigned long long count_matching_lines(const char *data, size_t size)
+{
+    const char *end = data + size;
+    const char *pos = data;
+    unsigned long long lines = 0;
+
+    if (match_nothing || memchr(data, '\0', size)) {
+        return 0;
+    }
+
+    if (!use_regex) {
+        /* Find the next occurrence, count its line and continue after the end of that line */
+        while (pos < end) {
+            const char *match = memmem(pos, end - pos, search, search_len);
+            const char *newline;
+            if (!match) {
+                break;
+            }
+            lines++;
+            newline = memchr(match, '\n', end - match);
+            if (!newline) {
+                break;
+            }
+            pos = newline + 1;
+        }
+        return lines;
+    }
+
+    while (pos < end) {
+        const char *newline = memchr(pos, '\n', end - pos);
+        const char *line_end = newline ? newline : end;
+        if (regex_line_matches(pos, line_end)) {
+            lines++;
+        }
+        pos = line_end + 1;
+    }
+    return lines;
+}
+
+static unsigned long long scan_file(int dirfd, const char *name)
+{
+    unsigned long long lines = 0;
+    struct stat st;
+    void *data;
+    int fd;
+
+    fd = openat(dirfd, name, O_RDONLY | O_NOFOLLOW | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+    if (fd == -1) {
+        return 0;
+    }
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED) {
+            madvise(data, st.st_size, MADV_SEQUENTIAL);
+            lines = count_matching_lines(data, st.st_size);
+            munmap(data, st.st_size);
+        }
+    }
+    close(fd);
+    return lines;
+}
+
+/**
+ * Count the regular files in directory @param path and the matching lines in them, pushing its
+ * subdirectories onto the deque of @param w.  Symbolic links are not followed, as with find
+ * and grep -r.
+ */
+static void walk_directory(struct worker *w, const char *path)
+{
+    struct dirent *entry;
+    DIR *dir;
+    int dirfd;
+
+    dirfd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dirfd == -1) {
+        return;
+    }
+    dir = fdopendir(dirfd);
+    if (!dir) {
+        close(dirfd);
+        return;
+    }
+
+    while ((entry = readdir(dir)) != NULL) {
+        unsigned char type = entry->d_type;
+
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        if (type == DT_UNKNOWN) {
+            struct stat st;
+            if (fstatat(dirfd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW) == -1) {
+                continue;
+            }
+            type = S_ISREG(st.st_mode) ? DT_REG : S_ISDIR(st.st_mode) ? DT_DIR : DT_UNKNOWN;
+        }
+
+        if (type == DT_REG) {
+            w->files++;
+            w->lines += scan_file(dirfd, entry->d_name);
+        } else if (type == DT_DIR) {
+            size_t len = strlen(path) + strlen(entry->d_name) + 2;
+            char *sub = malloc(len);
+            if (!sub) {
+                continue;
+            }
+            snprintf(sub, len, "%s/%s", path, entry->d_name);
+            atomic_fetch_add(&pending, 1);
+            if (!deque_push(&w->deque, sub)) {
+                /* Out of memory for the deque, walk it now instead */
+                walk_directory(w, sub);
+                free(sub);
+                atomic_fetch_sub(&pending, 1);
+            }
+        }
+    }
+    closedir(dir);
+}
+
+static void *worker_thread(void *arg)
+{
+    struct worker *w = arg;
+    unsigned int victim = w->index;
+
+    while (atomic_load(&pending) > 0) {
+        char *path = deque_pop(&w->deque);
+        int i;
+
+        for (i = 1; !path && i < nworkers; i++) {
+            victim = (victim + 1) % nworkers;
+            if (victim != (unsigned int)w->index) {
+                path = deque_steal(&workers[victim].deque);
+            }
+        }
+        if (!path) {
+            sched_yield();
+            continue;
+        }
+        walk_directory(w, path);
+        free(path);
+        atomic_fetch_sub(&pending, 1);
+    }
+    return NULL;
+}
+
+/**
+ * @return true if @param s contains characters with a special meaning in a basic regular expression
+ */
+static bool has_regex_chars(const char *s)
+{
+    return strpbrk(s, ".[]*^$\\") != NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned long long files = 0, lines = 0;
+    const char *threads_env;
+    char *root;
+    struct stat st;
+    long cpus;
+    int started;
+    int i;
+
+    if (argc != 3) {
+        printf("Usage: %s <path to directory> <search string>\n", argv[0]);
+        return 1;
+    }
+    if (stat(argv[1], &st) == -1 || !S_ISDIR(st.st_mode)) {
+        printf("Error: %s is not a valid directory.\n", argv[1]);
+        return 1;
+    }
+
+    search = argv[2];
+    search_len = strlen(search);
+    use_regex = has_regex_chars(search);
+    if (use_regex && regcomp(&regex, search, REG_NOSUB) != 0) {
+        /* grep reports the error and finds nothing */
+        use_regex = false;
+        match_nothing = true;
+    }
+
+    cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    nworkers = cpus > 0 ? cpus : 1;
+    threads_env = getenv("FINDER_THREADS");
+    if (threads_env && atoi(threads_env) > 0) {
+        nworkers = atoi(threads_env);
+    }
+    if (nworkers > FINDER_MAX_THREADS) {
+        nworkers = FINDER_MAX_THREADS;
+    }
+
+    root = strdup(argv[1]);
+    if (!root) {
+        return 1;
+    }
+    for (i = 0; i < nworkers; i++) {
+        workers[i].index = i;
+        pthread_mutex_init(&workers[i].deque.lock, NULL);
+    }
+    atomic_store(&pending, 1);
+    if (!deque_push(&workers[0].deque, root)) {
+        return 1;
+    }
+
+    /*
+     * nworkers is not changed once threads run.  If a thread fails to start, its deque stays
+     * empty and the others steal from it in vain, which is harmless.
+     */
+    for (started = 1; started < nworkers; started++) {
+        if (pthread_create(&workers[started].thread, NULL, worker_thread,
+                           &workers[started]) != 0) {
+            break;
+        }
+    }
+    worker_thread(&workers[0]);
+    for (i = 1; i < started; i++) {
+        pthread_join(workers[i].thread, NULL);
+    }
+
+    for (i = 0; i < nworkers; i++) {
+        files += workers[i].files;
+        lines += workers[i].lines;
+        free(workers[i].deque.path);
+    }
+    if (use_regex) {
+        regfree(&regex);
+    }
+
+    printf("The number of files are %llu and the number of matching lines are %llu\n", files, lines);
+    return 0;
+}
@@ -13,6 +13,16 @@ if [ ! -d "$filesdir" ]; then
     exit 1
 fi
 
+# Prefer the native finder built from finder.c, which prints the same line from a single
+# walk of the tree.  Fall back to find and grep if it is missing or can't run.
+finder_bin="$(dirname "$0")/finder"
+if [ ! -x "$finder_bin" ]; then
+    finder_bin=$(command -v finder 2>/dev/null)
+fi
+if [ -n "$finder_bin" ] && [ -x "$finder_bin" ] && "$finder_bin" "$filesdir" "$searchstr"; then
+    exit 0
+fi
+
 file_count=$(find "$filesdir" -type f | wc -l)
 match_count=$(grep -r "$searchstr" "$filesdir" 2>/dev/null | wc -l)
 
@@ -89,6 +89,10 @@ cp -a $SYSROOT/lib/ld-linux-aarch64.so.1 lib
 cp -a $SYSROOT/lib64/libm.so.6 lib64
 cp -a $SYSROOT/lib64/libresolv.so.2 lib64
 cp -a $SYSROOT/lib64/libc.so.6 lib64
+# finder uses threads, C libraries before glibc 2.34 keep them in a separate library
+if [ -e $SYSROOT/lib64/libpthread.so.0 ]; then
+    cp -a $SYSROOT/lib64/libpthread.so.0 lib64
+fi
 
 sudo mknod -m 666 dev/null c 1 3
 sudo mknod -m 600 dev/console c 5 1
@@ -98,6 +102,7 @@ make clean
 make CROSS_COMPILE=${CROSS_COMPILE}
 
 cp -a writer ${OUTDIR}/rootfs/home
+cp -a finder ${OUTDIR}/rootfs/home
 cp -a finder.sh ${OUTDIR}/rootfs/home
 cp -a finder-test.sh ${OUTDIR}/rootfs/home
 cp -a autorun-qemu.sh ${OUTDIR}/rootfs/home
@@ -1,27 +1,55 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
 #include <syslog.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
 
-int main(int argc, char *argv[]) {
-    openlog("writer-app", LOG_PID, LOG_USER);
+#define WRITER_MAX_THREADS 64
 
-    if (argc != 3) {
-        syslog(LOG_ERR, "Usage: %s <writefile> <writestr>", argv[0]);
-        fprintf(stderr, "Usage: %s <writefile> <writestr>\n", argv[0]);
-        closelog();
-        return 1;
-    }
+/**
+ * A set of files to create below one directory, with the name and content of file i
+ * given by name() and content()
+ */
+struct batch {
+    int dirfd;
+    size_t count;
+    /* --batch */
+    const char *prefix;
+    const char *suffix;
+    const char *writestr;
+    /* --manifest, parallel arrays of count names and strings */
+    char **names;
+    char **strings;
+    /* Index of the next file to create, shared between threads */
+    atomic_size_t next;
+    atomic_size_t failed;
+    /* The first failure, reported once in the summary */
+    pthread_mutex_t error_lock;
+    char error[PATH_MAX + 64];
+};
 
-    const char *writefile = argv[1];
-    const char *writestr = argv[2];
+static void usage(const char *prog)
+{
+    syslog(LOG_ERR, "Usage: %s <writefile> <writestr>", prog);
+    fprintf(stderr, "Usage: %s <writefile> <writestr>\n"
+            "       %s --batch <dir> <prefix> <suffix> <count> <writestr> [threads]\n"
+            "       %s --manifest <dir> [threads] < lines of <name><TAB><writestr>\n",
+            prog, prog, prog);
+}
 
+static int write_single(const char *writefile, const char *writestr)
+{
     int fd = open(writefile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
     if (fd == -1) {
         syslog(LOG_ERR, "File %s could not be opened or created", writefile);
         perror("Error opening file");
-        closelog();
         return 1;
     }
 
@@ -30,7 +58,6 @@ int main(int argc, char *argv[]) {
         syslog(LOG_ERR, "Could not write to file %s", writefile);
         perror("Error writing to file");
         close(fd);
-        closelog();
         return 1;
     }
 
@@ -38,7 +65,258 @@ int main(int argc, char *argv[]) {
     printf("Successfully wrote to the file %s\n", writefile);
 
     close(fd);
-    closelog();
+    return 0;
+}
+
+/**
+ * Create @param path and any missing parent directories, like mkdir -p
+ * @return 0 on success, -1 with errno set on failure
+ */
+static int mkdir_p(const char *path)
+{
+    char buf[PATH_MAX];
+    char *p;
+
+    if (snprintf(buf, sizeof(buf), "%s", path) >= (int)sizeof(buf)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    for (p = buf + 1; *p; p++) {
+        if (*p == '/') {
+            *p = '\0';
+            if (mkdir(buf, 0755) == -1 && errno != EEXIST) {
+                return -1;
+            }
+            *p = '/';
+        }
+    }
+    if (mkdir(buf, 0755) == -1 && errno != EEXIST) {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Create, truncate and fill file @param name relative to @param dirfd
+ * @return 0 on success or an errno value
+ */
+static int write_at(int dirfd, const char *name, const char *writestr)
+{
+    size_t len = strlen(writestr);
+    size_t done = 0;
+    int err = 0;
+    int fd;
+
+    fd = openat(dirfd, name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        return errno;
+    }
+    while (done < len) {
+        ssize_t nr = write(fd, writestr + done, len - done);
+        if (nr == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            err = errno;
+            break;
+        }
+        done += nr;
+    }
+    if (close(fd) == -1 && !err) {
+        err = errno;
+    }
+    return err;
+}
+
+static void *batch_thread(void *arg)
+{
+    struct batch *b = arg;
+    char name[PATH_MAX];
+    size_t i;
+
+    while ((i = atomic_fetch_add(&b->next, 1)) < b->count) {
+        const char *file = name;
+        const char *writestr = b->writestr;
+        int err;
+
+        if (b->names) {
+            file = b->names[i];
+            writestr = b->strings[i];
+        } else {
+            snprintf(name, sizeof(name), "%s%zu%s", b->prefix, i + 1, b->suffix);
+        }
+
+        err = write_at(b->dirfd, file, writestr);
+        if (err) {
+            if (atomic_fetch_add(&b->failed, 1) == 0) {
+                pthread_mutex_lock(&b->error_lock);
+                snprintf(b->error, sizeof(b->error), "%s: %s", file, strerror(err));
+                pthread_mutex_unlock(&b->error_lock);
+            }
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Create the files of @param b below @param dir with @param threads threads, logging one
+ * summary line rather than one line per file
+ * @return the exit status for main()
+ */
+static int run_batch(struct batch *b, const char *dir, int threads)
+{
+    pthread_t thread[WRITER_MAX_THREADS];
+    int started = 0;
+    int i;
+
+    if (mkdir_p(dir) == -1) {
+        syslog(LOG_ERR, "Directory %s could not be created", dir);
+        perror("Error creating directory");
+        return 1;
+    }
+    b->dirfd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (b->dirfd == -1) {
+        syslog(LOG_ERR, "Directory %s could not be opened", dir);
+        perror("Error opening directory");
+        return 1;
+    }
+    pthread_mutex_init(&b->error_lock, NULL);
 
+    if (threads < 1) {
+        threads = 1;
+    }
+    if (threads > WRITER_MAX_THREADS) {
+        threads = WRITER_MAX_THREADS;
+    }
+    for (i = 1; i < threads; i++) {
+        if (pthread_create(&thread[started], NULL, batch_thread, b) != 0) {
+            break;
+        }
+        started++;
+    }
+    batch_thread(b);
+    for (i = 0; i < started; i++) {
+        pthread_join(thread[i], NULL);
+    }
+    close(b->dirfd);
+
+    size_t failed = atomic_load(&b->failed);
+    if (failed) {
+        syslog(LOG_ERR, "Could not write %zu of %zu files in '%s', first error %s",
+               failed, b->count, dir, b->error);
+        fprintf(stderr, "Could not write %zu of %zu files in %s, first error %s\n",
+                failed, b->count, dir, b->error);
+        return 1;
+    }
+    syslog(LOG_DEBUG, "Wrote %zu files in '%s'", b->count, dir);
+    printf("Successfully wrote %zu files in %s\n", b->count, dir);
     return 0;
 }
+
+/**
+ * Read the manifest from standard input into @param b, one file per line as
+ * <name><TAB><writestr>, with the name relative to the batch directory
+ * @return true on success
+ */
+static bool read_manifest(struct batch *b)
+{
+    size_t cap = 0;
+    char *line = NULL;
+    size_t line_cap = 0;
+    ssize_t len;
+    bool ok = true;
+
+    while ((len = getline(&line, &line_cap, stdin)) != -1) {
+        char *tab;
+
+        if (len > 0 && line[len - 1] == '\n') {
+            line[--len] = '\0';
+        }
+        if (len == 0) {
+            continue;
+        }
+        tab = strchr(line, '\t');
+        if (!tab || tab == line) {
+            fprintf(stderr, "Invalid manifest line: %s\n", line);
+            ok = false;
+            break;
+        }
+        *tab = '\0';
+
+        if (b->count == cap) {
+            size_t new_cap = cap ? cap * 2 : 64;
+            char **names = realloc(b->names, new_cap * sizeof(*names));
+            char **strings = names ? realloc(b->strings, new_cap * sizeof(*strings)) : NULL;
+            if (names) {
+                b->names = names;
+            }
+            if (!strings) {
+                ok = false;
+                break;
+            }
+            b->strings = strings;
+            cap = new_cap;
+        }
+        b->names[b->count] = strdup(line);
+        b->strings[b->count] = strdup(tab + 1);
+        if (!b->names[b->count] || !b->strings[b->count]) {
+            free(b->names[b->count]);
+            free(b->strings[b->count]);
+            ok = false;
+            break;
+        }
+        b->count++;
+    }
+    free(line);
+    return ok;
+}
+
+static void free_manifest(struct batch *b)
+{
+    size_t i;
+
+    for (i = 0; i < b->count; i++) {
+        free(b->names[i]);
+        free(b->strings[i]);
+    }
+    free(b->names);
+    free(b->strings);
+}
+
+int main(int argc, char *argv[]) {
+    struct batch batch;
+    int ret;
+
+    openlog("writer-app", LOG_PID, LOG_USER);
+    memset(&batch, 0, sizeof(batch));
+
+    if (argc >= 7 && argc <= 8 && strcmp(argv[1], "--batch") == 0) {
+        char *end;
+        batch.prefix = argv[3];
+        batch.suffix = argv[4];
+        batch.count = strtoul(argv[5], &end, 10);
+        batch.writestr = argv[6];
+        if (*end != '\0' || argv[5][0] == '\0') {
+            usage(argv[0]);
+            ret = 1;
+        } else {
+            ret = run_batch(&batch, argv[2], argc == 8 ? atoi(argv[7]) : 1);
+        }
+    } else if (argc >= 3 && argc <= 4 && strcmp(argv[1], "--manifest") == 0) {
+        if (read_manifest(&batch)) {
+            ret = run_batch(&batch, argv[2], argc == 4 ? atoi(argv[3]) : 1);
+        } else {
+            syslog(LOG_ERR, "Could not read the manifest");
+            ret = 1;
+        }
+        free_manifest(&batch);
+    } else if (argc == 3) {
+        ret = write_single(argv[1], argv[2]);
+    } else {
+        usage(argv[0]);
+        ret = 1;
+    }
+
+    closelog();
+    return ret;
+}
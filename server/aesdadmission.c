@@ -0,0 +1,74 @@
+#include "aesdadmission.h"
+
+void bucket_init(struct token_bucket *b, double rate, double burst, uint64_t now) {
+    b->rate = rate;
+    b->burst = burst;
+    b->tokens = burst;
+    b->last_ns = now;
+}
+
+static void bucket_refill(struct token_bucket *b, uint64_t now) {
+    if (now > b->last_ns) {
+        b->tokens += (now - b->last_ns) / 1e9 * b->rate;
+        if (b->tokens > b->burst) {
+            b->tokens = b->burst;
+        }
+        b->last_ns = now;
+    }
+}
+
+bool buckets_take(struct token_bucket *packets, struct token_bucket *bytes, size_t len,
+                  uint64_t now) {
+    bool limit_packets = packets->rate > 0;
+    bool limit_bytes = bytes->rate > 0;
+
+    if (limit_packets) {
+        bucket_refill(packets, now);
+    }
+    if (limit_bytes) {
+        bucket_refill(bytes, now);
+    }
+    if ((limit_packets && packets->tokens <= 0) || (limit_bytes && bytes->tokens <= 0)) {
+        return false;
+    }
+    if (limit_packets) {
+        packets->tokens -= 1;
+    }
+    if (limit_bytes) {
+        bytes->tokens -= len;
+    }
+    return true;
+}
+
+static uint64_t decay(uint64_t avg, uint64_t last, uint64_t now) {
+    uint64_t half_lives = now > last ? (now - last) / LOCK_WAIT_HALF_LIFE_NS : 0;
+    return half_lives >= 64 ? 0 : avg >> half_lives;
+}
+
+void lock_wait_sample(struct lock_wait_avg *a, uint64_t wait_ns, uint64_t now) {
+    uint64_t avg = decay(atomic_load_explicit(&a->avg_ns, memory_order_relaxed),
+                         atomic_load_explicit(&a->last_ns, memory_order_relaxed), now);
+
+    avg = avg - (avg >> LOCK_WAIT_EWMA_SHIFT) + (wait_ns >> LOCK_WAIT_EWMA_SHIFT);
+    atomic_store_explicit(&a->avg_ns, avg, memory_order_relaxed);
+    atomic_store_explicit(&a->last_ns, now, memory_order_relaxed);
+}
+
+uint64_t lock_wait_current(struct lock_wait_avg *a, uint64_t now) {
+    return decay(atomic_load_explicit(&a->avg_ns, memory_order_relaxed),
+                 atomic_load_explicit(&a->last_ns, memory_order_relaxed), now);
+}
+
+enum admission admission_check(const struct admission_limits *limits, int lock_waiters,
+                               struct lock_wait_avg *lock_wait, struct token_bucket *packets,
+                               struct token_bucket *bytes, size_t len, uint64_t now) {
+    if ((limits->max_lock_waiters && lock_waiters >= limits->max_lock_waiters) ||
+        (limits->max_lock_wait_ms &&
+         lock_wait_current(lock_wait, now) > limits->max_lock_wait_ms * 1000000ULL)) {
+        return SHED_BUSY;
+    }
+    if (!buckets_take(packets, bytes, len, now)) {
+        return SHED_RATE;
+    }
+    return ADMIT;
+}
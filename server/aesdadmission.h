@@ -0,0 +1,85 @@
+#ifndef AESDADMISSION_H
+#define AESDADMISSION_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+/**
+ * The measurements aesdsocket bases admission control on.  Times are in ns from the same
+ * monotonic clock, passed in so the behaviour over time can be tested.
+ */
+
+/**
+ * A token bucket, refilled at rate tokens per second up to burst tokens.  A request may take
+ * the bucket into debt, so requests larger than the burst are still served once it is full.
+ */
+struct token_bucket {
+    double tokens;
+    double rate;
+    double burst;
+    uint64_t last_ns;
+};
+
+void bucket_init(struct token_bucket *b, double rate, double burst, uint64_t now);
+
+/**
+ * Take 1 token from @param packets and @param len from @param bytes, only if both have tokens
+ * left.  A bucket with no rate never limits.
+ * @return true if the packet is within both rates
+ */
+bool buckets_take(struct token_bucket *packets, struct token_bucket *bytes, size_t len,
+                  uint64_t now);
+
+/**
+ * Moving average of the time taken to acquire a lock.  Each sample has a weight of
+ * 1/2^LOCK_WAIT_EWMA_SHIFT, and the average halves for every LOCK_WAIT_HALF_LIFE_NS without a
+ * sample, so it recovers after a spike even when everything is being shed and nothing takes
+ * the lock to add a sample.
+ */
+#define LOCK_WAIT_EWMA_SHIFT   3
+#define LOCK_WAIT_HALF_LIFE_NS 100000000ULL
+
+struct lock_wait_avg {
+    atomic_uint_least64_t avg_ns;
+    atomic_uint_least64_t last_ns;
+};
+
+/**
+ * Add a wait of @param wait_ns ending at @param now.  Called with the lock held, so samples
+ * are never added concurrently.
+ */
+void lock_wait_sample(struct lock_wait_avg *a, uint64_t wait_ns, uint64_t now);
+
+/**
+ * @return the average wait at @param now, decayed since the last sample
+ */
+uint64_t lock_wait_current(struct lock_wait_avg *a, uint64_t now);
+
+/**
+ * Overload limits of admission_check(), a limit of 0 disables it
+ */
+struct admission_limits {
+    int max_lock_waiters;
+    int max_lock_wait_ms;
+};
+
+enum admission {
+    ADMIT,
+    /* Shed because of the load on the lock */
+    SHED_BUSY,
+    /* Shed because the connection is over its rate */
+    SHED_RATE,
+};
+
+/**
+ * Decide whether a packet of @param len bytes is stored, with @param lock_waiters threads queued
+ * for the lock and the connection's buckets @param packets and @param bytes.  The buckets are
+ * charged last, only for a packet that is admitted.
+ */
+enum admission admission_check(const struct admission_limits *limits, int lock_waiters,
+                               struct lock_wait_avg *lock_wait, struct token_bucket *packets,
+                               struct token_bucket *bytes, size_t len, uint64_t now);
+
+#endif /* AESDADMISSION_H */
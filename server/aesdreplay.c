@@ -0,0 +1,540 @@
+/**
+ * aesdreplay: replay a traffic trace recorded with "aesdsocket -r <trace>" against a running
+ * aesdsocket, and compare the latency and throughput seen with those of the recording.
+ *
+ * Each recorded connection is replayed on its own connection and thread, opened, sent its
+ * packets and closed at the recorded times divided by the speed, or as fast as possible with -f.
+ * A response is the BUSY reply, or the device contents, which end with the packet just sent as
+ * under file_mutex it is the last data the server wrote.  The contents may hold earlier copies
+ * of the same packet, so a response ending with it is only complete once no more data arrives
+ * for RESPONSE_IDLE_MS, which is not counted in its latency.  Responses to seekto commands end
+ * with whatever is last in the device, so any data received is waited on the same way.
+ *
+ * The recorded latency is the server side service time, from receiving a packet to having sent
+ * the response.  The replayed latency is seen by the client, from sending a packet to receiving
+ * the whole response, so it also includes the network.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "aesdtrace.h"
+
+#define AESD_IOCTL_CMD     "AESDCHAR_IOCSEEKTO:"
+#define BUSY_REPLY         "BUSY\n"
+#define RESPONSE_IDLE_MS   10
+#define RESPONSE_TIMEOUT_MS 10000
+#define REPLAY_STACK_SIZE  (256 * 1024)
+
+struct replay_packet {
+    uint64_t time_ns;
+    const char *data;
+    uint32_t len;
+    uint32_t service_us;
+    uint16_t flags;
+};
+
+struct replay_conn {
+    /* The server process and its number for the connection */
+    uint32_t pid;
+    uint32_t id;
+    uint64_t open_ns;
+    uint64_t close_ns;
+    bool has_close;
+    struct replay_packet *packets;
+    size_t count;
+    size_t cap;
+    pthread_t thread;
+    bool started;
+    /* Results, latency_ns[i] of packets[i] is 0 if it got no response */
+    uint64_t *latency_ns;
+    size_t busy;
+    size_t errors;
+    /* When the first packet was sent and the last response received */
+    uint64_t first_sent_ns;
+    uint64_t last_done_ns;
+};
+
+static struct replay_conn *conns;
+static size_t nconns;
+static struct addrinfo *server;
+/* Used as server with -U */
+static struct addrinfo unix_server;
+static struct sockaddr_un unix_addr;
+static double speed = 1.0;
+static uint64_t replay_start_ns;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Sleep until time @param trace_ns of the recording, scaled by the replay speed
+ */
+static void sleep_until(uint64_t trace_ns) {
+    struct timespec ts;
+    uint64_t at;
+
+    if (speed <= 0) {
+        return;
+    }
+    at = replay_start_ns + (uint64_t)(trace_ns / speed);
+    ts.tv_sec = at / 1000000000ULL;
+    ts.tv_nsec = at % 1000000000ULL;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+    }
+}
+
+/**
+ * @return the connection with @param id in server process @param pid, added if it is not known
+ * yet, or NULL if out of memory
+ */
+static struct replay_conn *find_conn(uint32_t pid, uint32_t id) {
+    static size_t cap;
+    size_t i;
+
+    /* Connections are numbered in the order they were accepted, so look from the end */
+    for (i = nconns; i > 0; i--) {
+        if (conns[i - 1].id == id && conns[i - 1].pid == pid) {
+            return &conns[i - 1];
+        }
+    }
+    if (nconns == cap) {
+        size_t new_cap = cap ? cap * 2 : 64;
+        struct replay_conn *tmp = realloc(conns, new_cap * sizeof(*conns));
+        if (!tmp) {
+            return NULL;
+        }
+        conns = tmp;
+        cap = new_cap;
+    }
+    memset(&conns[nconns], 0, sizeof(conns[nconns]));
+    conns[nconns].pid = pid;
+    conns[nconns].id = id;
+    return &conns[nconns++];
+}
+
+static int compare_conn_open(const void *a, const void *b) {
+    const struct replay_conn *ca = a, *cb = b;
+    return ca->open_ns < cb->open_ns ? -1 : ca->open_ns > cb->open_ns;
+}
+
+/**
+ * Read the trace at @param path into conns, which point into the returned buffer
+ * @return the trace data or NULL with an error printed
+ */
+static char *load_trace(const char *path) {
+    struct aesd_trace_header header;
+    struct stat st;
+    char *data = NULL;
+    size_t pos;
+    FILE *f;
+
+    f = fopen(path, "re");
+    if (!f) {
+        fprintf(stderr, "Could not open %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+    if (fstat(fileno(f), &st) == -1 || (size_t)st.st_size < sizeof(header) ||
+        !(data = malloc(st.st_size)) || fread(data, st.st_size, 1, f) != 1) {
+        fprintf(stderr, "Could not read %s\n", path);
+        goto fail;
+    }
+    memcpy(&header, data, sizeof(header));
+    if (memcmp(header.magic, AESD_TRACE_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != AESD_TRACE_VERSION ||
+        header.record_size != sizeof(struct aesd_trace_record)) {
+        fprintf(stderr, "%s is not an aesdsocket trace of version %d\n", path, AESD_TRACE_VERSION);
+        goto fail;
+    }
+
+    pos = sizeof(header);
+    while (pos + sizeof(struct aesd_trace_record) <= (size_t)st.st_size) {
+        struct aesd_trace_record record;
+        struct replay_conn *conn;
+
+        memcpy(&record, data + pos, sizeof(record));
+        pos += sizeof(record);
+        if (record.len > st.st_size - pos) {
+            /* Cut short while recording, keep what is complete */
+            break;
+        }
+        conn = find_conn(record.pid, record.conn);
+        if (!conn) {
+            fprintf(stderr, "Out of memory\n");
+            goto fail;
+        }
+        switch (record.type) {
+        case AESD_TRACE_OPEN:
+            conn->open_ns = record.time_ns;
+            break;
+        case AESD_TRACE_CLOSE:
+            conn->close_ns = record.time_ns;
+            conn->has_close = true;
+            break;
+        case AESD_TRACE_PACKET:
+            if (conn->count == conn->cap) {
+                size_t new_cap = conn->cap ? conn->cap * 2 : 16;
+                struct replay_packet *tmp = realloc(conn->packets, new_cap * sizeof(*tmp));
+                if (!tmp) {
+                    fprintf(stderr, "Out of memory\n");
+                    goto fail;
+                }
+                conn->packets = tmp;
+                conn->cap = new_cap;
+            }
+            conn->packets[conn->count++] = (struct replay_packet) {
+                .time_ns = record.time_ns,
+                .data = data + pos,
+                .len = record.len,
+                .service_us = record.service_us,
+                .flags = record.flags,
+            };
+            break;
+        }
+        pos += record.len;
+    }
+    fclose(f);
+    qsort(conns, nconns, sizeof(*conns), compare_conn_open);
+    return data;
+
+fail:
+    fclose(f);
+    free(data);
+    return NULL;
+}
+
+static bool is_seekto(const struct replay_packet *p) {
+    return p->len >= strlen(AESD_IOCTL_CMD) &&
+           memcmp(p->data, AESD_IOCTL_CMD, strlen(AESD_IOCTL_CMD)) == 0;
+}
+
+/**
+ * Read the response to packet @param p from @param fd
+ * @return the time the response was complete, 0 on error, with @param busy set if it was BUSY
+ */
+static uint64_t read_response(int fd, const struct replay_packet *p, bool *busy) {
+    bool seekto = is_seekto(p);
+    char *tail = malloc(p->len ? p->len : 1);
+    size_t tail_len = 0, total = 0;
+    bool ended = false;
+    uint64_t done = 0, last = 0;
+    char buf[16384];
+
+    *busy = false;
+    if (!tail) {
+        return 0;
+    }
+    for (;;) {
+        struct pollfd pfd = { .fd = fd, .events = POLLIN };
+        int ready = poll(&pfd, 1, ended ? RESPONSE_IDLE_MS : RESPONSE_TIMEOUT_MS);
+        ssize_t n;
+
+        if (ready == 0 && ended) {
+            done = last;
+            break;
+        }
+        if (ready <= 0) {
+            if (ready < 0 && errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        n = recv(fd, buf, sizeof(buf), 0);
+        if (n <= 0) {
+            break;
+        }
+        last = now_ns();
+        if (total == 0 && n == (ssize_t)strlen(BUSY_REPLY) &&
+            memcmp(buf, BUSY_REPLY, n) == 0) {
+            *busy = true;
+            done = last;
+            break;
+        }
+        total += n;
+        if (seekto) {
+            ended = true;
+            continue;
+        }
+        /* Keep the last p->len bytes received */
+        if ((size_t)n >= p->len) {
+            memcpy(tail, buf + n - p->len, p->len);
+            tail_len = p->len;
+        } else {
+            size_t keep = tail_len + n > p->len ? p->len - n : tail_len;
+            memmove(tail, tail + tail_len - keep, keep);
+            memcpy(tail + keep, buf, n);
+            tail_len = keep + n;
+        }
+        ended = tail_len == p->len && memcmp(tail, p->data, p->len) == 0;
+    }
+    free(tail);
+    return done;
+}
+
+static bool send_all(int fd, const char *data, size_t len) {
+    while (len) {
+        ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+static void *replay_thread(void *arg) {
+    struct replay_conn *conn = arg;
+    size_t i;
+    int fd;
+
+    fd = socket(server->ai_family, server->ai_socktype | SOCK_CLOEXEC, server->ai_protocol);
+    if (fd < 0 || connect(fd, server->ai_addr, server->ai_addrlen) < 0) {
+        fprintf(stderr, "Connection %u of pid %u: could not connect: %s\n", conn->id, conn->pid,
+                strerror(errno));
+        conn->errors = conn->count;
+        if (fd >= 0) {
+            close(fd);
+        }
+        return NULL;
+    }
+    for (i = 0; i < conn->count; i++) {
+        const struct replay_packet *p = &conn->packets[i];
+        uint64_t sent, done;
+        bool busy;
+
+        sleep_until(p->time_ns);
+        sent = now_ns();
+        if (!send_all(fd, p->data, p->len)) {
+            break;
+        }
+        done = read_response(fd, p, &busy);
+        if (!done) {
+            break;
+        }
+        conn->latency_ns[i] = done - sent;
+        if (!conn->first_sent_ns) {
+            conn->first_sent_ns = sent;
+        }
+        conn->last_done_ns = done;
+        conn->busy += busy;
+    }
+    conn->errors += conn->count - i;
+    if (conn->has_close) {
+        sleep_until(conn->close_ns);
+    }
+    close(fd);
+    return NULL;
+}
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * @return the @param pct percentile of the @param n sorted values at @param v
+ */
+static uint64_t percentile(const uint64_t *v, size_t n, double pct) {
+    size_t i;
+
+    if (!n) {
+        return 0;
+    }
+    i = (size_t)(pct / 100.0 * n);
+    return v[i < n ? i : n - 1];
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-H host] [-p port | -U path] [-s speed | -f] <trace>\n"
+            "  -H  server host, default localhost\n"
+            "  -p  server port, default 9000\n"
+            "  -U  connect to the server's Unix socket at path instead\n"
+            "  -s  replay speed, 1 replays at the recorded pace and 10 ten times faster\n"
+            "  -f  replay as fast as possible\n", prog);
+}
+
+int main(int argc, char *argv[]) {
+    const char *host = "localhost", *port = "9000", *unix_path = NULL;
+    uint64_t *recorded, *replayed, first_ns = UINT64_MAX, last_ns = 0;
+    uint64_t first_sent_ns = UINT64_MAX, last_done_ns = 0;
+    size_t packets = 0, nrecorded = 0, nreplayed = 0;
+    size_t recorded_busy = 0, busy = 0, errors = 0;
+    struct addrinfo hints = { .ai_socktype = SOCK_STREAM };
+    pthread_attr_t attr;
+    char *trace;
+    size_t i, j;
+    int opt, err;
+
+    while ((opt = getopt(argc, argv, "H:p:U:s:fh")) != -1) {
+        switch (opt) {
+        case 'H':
+            host = optarg;
+            break;
+        case 'p':
+            port = optarg;
+            break;
+        case 'U':
+            unix_path = optarg;
+            break;
+        case 's':
+            speed = strtod(optarg, NULL);
+            if (speed <= 0) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'f':
+            speed = 0;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind != argc - 1) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (unix_path) {
+        if (strlen(unix_path) >= sizeof(unix_addr.sun_path)) {
+            fprintf(stderr, "Socket path %s is too long\n", unix_path);
+            return 1;
+        }
+        unix_addr.sun_family = AF_UNIX;
+        strcpy(unix_addr.sun_path, unix_path);
+        unix_server.ai_family = AF_UNIX;
+        unix_server.ai_socktype = SOCK_STREAM;
+        unix_server.ai_addr = (struct sockaddr *)&unix_addr;
+        unix_server.ai_addrlen = sizeof(unix_addr);
+        server = &unix_server;
+    } else {
+        err = getaddrinfo(host, port, &hints, &server);
+        if (err) {
+            fprintf(stderr, "Could not resolve %s:%s: %s\n", host, port, gai_strerror(err));
+            return 1;
+        }
+    }
+    trace = load_trace(argv[optind]);
+    if (!trace) {
+        return 1;
+    }
+    for (i = 0; i < nconns; i++) {
+        packets += conns[i].count;
+        conns[i].latency_ns = calloc(conns[i].count ? conns[i].count : 1, sizeof(uint64_t));
+        if (!conns[i].latency_ns) {
+            fprintf(stderr, "Out of memory\n");
+            return 1;
+        }
+    }
+    recorded = calloc(packets ? packets : 1, sizeof(uint64_t));
+    replayed = calloc(packets ? packets : 1, sizeof(uint64_t));
+    if (!recorded || !replayed) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, REPLAY_STACK_SIZE);
+    replay_start_ns = now_ns();
+    for (i = 0; i < nconns; i++) {
+        sleep_until(conns[i].open_ns);
+        err = pthread_create(&conns[i].thread, &attr, replay_thread, &conns[i]);
+        if (err) {
+            fprintf(stderr, "Connection %u of pid %u: could not start a thread: %s\n",
+                    conns[i].id, conns[i].pid, strerror(err));
+            conns[i].errors = conns[i].count;
+            continue;
+        }
+        conns[i].started = true;
+    }
+    for (i = 0; i < nconns; i++) {
+        if (conns[i].started) {
+            pthread_join(conns[i].thread, NULL);
+        }
+    }
+    pthread_attr_destroy(&attr);
+
+    for (i = 0; i < nconns; i++) {
+        for (j = 0; j < conns[i].count; j++) {
+            const struct replay_packet *p = &conns[i].packets[j];
+            if (p->time_ns < first_ns) {
+                first_ns = p->time_ns;
+            }
+            if (p->time_ns + p->service_us * 1000ULL > last_ns) {
+                last_ns = p->time_ns + p->service_us * 1000ULL;
+            }
+            recorded_busy += !!(p->flags & AESD_TRACE_BUSY);
+            recorded[nrecorded++] = (uint64_t)p->service_us * 1000;
+            if (conns[i].latency_ns[j]) {
+                replayed[nreplayed++] = conns[i].latency_ns[j];
+            }
+        }
+        if (conns[i].first_sent_ns && conns[i].first_sent_ns < first_sent_ns) {
+            first_sent_ns = conns[i].first_sent_ns;
+        }
+        if (conns[i].last_done_ns > last_done_ns) {
+            last_done_ns = conns[i].last_done_ns;
+        }
+        busy += conns[i].busy;
+        errors += conns[i].errors;
+    }
+    qsort(recorded, nrecorded, sizeof(*recorded), compare_u64);
+    qsort(replayed, nreplayed, sizeof(*replayed), compare_u64);
+
+    /* From the first packet being received or sent to the last response */
+    double recorded_s = packets ? (last_ns - first_ns) / 1e9 : 0;
+    double replayed_s = nreplayed ? (last_done_ns - first_sent_ns) / 1e9 : 0;
+    printf("Replayed %zu connections and %zu packets", nconns, packets);
+    if (speed > 0) {
+        printf(" at %gx speed\n", speed);
+    } else {
+        printf(" as fast as possible\n");
+    }
+    printf("%-22s %14s %14s\n", "", "recorded", "replayed");
+    printf("%-22s %14.3f %14.3f\n", "duration (s)", recorded_s, replayed_s);
+    printf("%-22s %14.1f %14.1f\n", "packets/s",
+           recorded_s > 0 ? packets / recorded_s : 0.0,
+           replayed_s > 0 ? nreplayed / replayed_s : 0.0);
+    printf("%-22s %14.1f %14.1f\n", "latency p50 (us)",
+           percentile(recorded, nrecorded, 50) / 1e3, percentile(replayed, nreplayed, 50) / 1e3);
+    printf("%-22s %14.1f %14.1f\n", "latency p99 (us)",
+           percentile(recorded, nrecorded, 99) / 1e3, percentile(replayed, nreplayed, 99) / 1e3);
+    printf("%-22s %14.1f %14.1f\n", "latency max (us)",
+           nrecorded ? recorded[nrecorded - 1] / 1e3 : 0.0,
+           nreplayed ? replayed[nreplayed - 1] / 1e3 : 0.0);
+    printf("%-22s %14zu %14zu\n", "busy replies", recorded_busy, busy);
+    printf("%-22s %14s %14zu\n", "packets without reply", "", errors);
+    printf("Recorded latency is server side service time, replayed latency is client side\n");
+
+    for (i = 0; i < nconns; i++) {
+        free(conns[i].packets);
+        free(conns[i].latency_ns);
+    }
+    free(conns);
+    free(recorded);
+    free(replayed);
+    free(trace);
+    if (server != &unix_server) {
+        freeaddrinfo(server);
+    }
+    return errors ? 1 : 0;
+}
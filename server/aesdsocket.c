@@ -1,25 +1,63 @@
-#define _POSIX_C_SOURCE 200809L
+#define _GNU_SOURCE // accept4()
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <syslog.h>
 #include <fcntl.h>
 #include <signal.h>
 #include <pthread.h>
 #include <time.h>
 #include <sys/queue.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <limits.h>
+#include <ctype.h>
+#include <poll.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
 #include "../aesd-char-driver/aesd_ioctl.h"
+#include "aesdtrace.h"
+#include "aesdadmission.h"
 
 #define AESD_IOCTL_CMD     "AESDCHAR_IOCSEEKTO:"
+#define BUSY_REPLY         "BUSY\n"
+
+/*
+ * Defaults of the settings in struct server_config, which can be changed at run time with a
+ * config file or command line options, see usage().
+ */
 #define PORT               9000
 #define BACKLOG            5
 #define BUFFER_SIZE        1024
+#define MAX_BUFFER_SIZE    (1024 * 1024) /* allocated for every connection */
+#define UNIX_PATH          "/var/run/aesdsocket.sock"
+#define CONTROL_PATH       "/var/run/aesdsocket.ctl"
+#define DRAIN_TIMEOUT_MS   5000
+#define SENDFILE_CHUNK     (1024 * 1024)
+
+/*
+ * Overload protection.  A connection beyond MAX_CONNECTIONS is sent BUSY_REPLY and closed.  A
+ * packet is answered with BUSY_REPLY instead of being stored when MAX_LOCK_WAITERS threads are
+ * already queued for file_mutex, when the average wait for it exceeds MAX_LOCK_WAIT_MS, or
+ * when its connection is over the per connection packet or byte rate.  A limit of 0 disables it.
+ */
+#define MAX_CONNECTIONS    64
+#define MAX_LOCK_WAITERS   16
+#define MAX_LOCK_WAIT_MS   250
+#define RATE_PACKETS       200      /* packets per second per connection */
+#define BURST_PACKETS      400
+#define RATE_BYTES         (1024 * 1024) /* bytes per second per connection */
+#define BURST_BYTES        (4 * 1024 * 1024)
 
 #ifndef USE_AESD_CHAR_DEVICE
 #define USE_AESD_CHAR_DEVICE 1
@@ -31,9 +69,177 @@
 #define STORAGE_PATH "/var/tmp/aesdsocketdata"
 #endif
 
+/**
+ * Run time settings, set up by main() before any client thread starts and read only after that
+ */
+struct server_config {
+    int port;
+    int backlog;
+    /* Size of the receive and file read buffer of each connection */
+    int buffer_size;
+    char storage_path[PATH_MAX];
+    /* Trace file to record incoming traffic to, see aesdtrace.h, empty to not record */
+    char record_path[PATH_MAX];
+    /* SO_RCVBUF and SO_SNDBUF of client sockets, 0 keeps the kernel default */
+    int rcvbuf;
+    int sndbuf;
+    /* Set TCP_NODELAY on client sockets */
+    int nodelay;
+    /* Hold partial segments with TCP_CORK while a response is sent */
+    int cork;
+    int max_connections;
+    int max_lock_waiters;
+    int max_lock_wait_ms;
+    int rate_packets;
+    int burst_packets;
+    int rate_bytes;
+    int burst_bytes;
+    /* Unix stream socket to accept local clients on as well, empty for TCP only */
+    char unix_path[PATH_MAX];
+    /* Unix socket a new instance started with -u takes the listening sockets over from */
+    char control_path[PATH_MAX];
+    /* Ask for the open client connections too when taking over with -u */
+    int handoff_clients;
+    /* How long a connection may take to finish a partial packet when stopping or upgrading */
+    int drain_timeout_ms;
+};
+
+struct server_config config = {
+    .port = PORT,
+    .backlog = BACKLOG,
+    .buffer_size = BUFFER_SIZE,
+    .storage_path = STORAGE_PATH,
+    .max_connections = MAX_CONNECTIONS,
+    .max_lock_waiters = MAX_LOCK_WAITERS,
+    .max_lock_wait_ms = MAX_LOCK_WAIT_MS,
+    .rate_packets = RATE_PACKETS,
+    .burst_packets = BURST_PACKETS,
+    .rate_bytes = RATE_BYTES,
+    .burst_bytes = BURST_BYTES,
+    .unix_path = UNIX_PATH,
+    .control_path = CONTROL_PATH,
+    .drain_timeout_ms = DRAIN_TIMEOUT_MS,
+};
+
+/**
+ * The string settings by name, as used in the config file and with -o
+ */
+static const struct {
+    const char *name;
+    char *value;
+    size_t size;
+    bool empty_ok;
+} string_settings[] = {
+    { "storage_path", config.storage_path, sizeof(config.storage_path), false },
+    { "record_path", config.record_path, sizeof(config.record_path), true },
+    { "unix_path", config.unix_path, sizeof(config.unix_path), true },
+    { "control_path", config.control_path, sizeof(config.control_path), true },
+};
+
+/**
+ * The integer settings by name, as used in the config file and with -o, and their valid range
+ */
+static const struct {
+    const char *name;
+    int *value;
+    int min;
+    int max;
+} int_settings[] = {
+    { "port", &config.port, 1, 65535 },
+    { "backlog", &config.backlog, 1, 65535 },
+    { "buffer_size", &config.buffer_size, 2, MAX_BUFFER_SIZE },
+    { "rcvbuf", &config.rcvbuf, 0, INT_MAX },
+    { "sndbuf", &config.sndbuf, 0, INT_MAX },
+    { "nodelay", &config.nodelay, 0, 1 },
+    { "cork", &config.cork, 0, 1 },
+    { "max_connections", &config.max_connections, 0, INT_MAX },
+    { "max_lock_waiters", &config.max_lock_waiters, 0, INT_MAX },
+    { "max_lock_wait_ms", &config.max_lock_wait_ms, 0, INT_MAX },
+    { "rate_packets", &config.rate_packets, 0, INT_MAX },
+    { "burst_packets", &config.burst_packets, 0, INT_MAX },
+    { "rate_bytes", &config.rate_bytes, 0, INT_MAX },
+    { "burst_bytes", &config.burst_bytes, 0, INT_MAX },
+    { "handoff_clients", &config.handoff_clients, 0, 1 },
+    { "drain_timeout_ms", &config.drain_timeout_ms, 0, INT_MAX },
+};
+
 volatile sig_atomic_t stop_server = 0;
+/*
+ * Written to by signal_handler() and when handing over to a new instance, and never read, so it
+ * stays readable and wakes up the accept loop and every client thread waiting in poll()
+ */
+int stop_pipe[2] = { -1, -1 };
+/* Set once client threads should finish their current packet and end their connection */
+atomic_bool draining;
+
+/*
+ * Upgrade handoff.  A new instance started with -u connects to the control socket of the
+ * running one and sends HANDOFF_REQUEST.  The running instance answers with HANDOFF_LISTENERS
+ * carrying its listening sockets, stops accepting and drains, then sends the connections it
+ * was serving in HANDOFF_CLIENTS messages if the new instance asked for them, and exits.
+ * The file descriptors are passed with SCM_RIGHTS.
+ */
+#define MAX_LISTENERS      4
+#define HANDOFF_MAX_FDS    64
+
+enum handoff_type {
+    HANDOFF_REQUEST = 1,
+    HANDOFF_LISTENERS,
+    HANDOFF_CLIENTS,
+};
+
+/* HANDOFF_REQUEST flag: also pass the open client connections */
+#define HANDOFF_WANT_CLIENTS 0x1
+
+struct handoff_msg {
+    uint32_t type;
+    /* Number of file descriptors passed with the message */
+    uint32_t count;
+    uint32_t flags;
+    /* enum listener_kind of each listening socket passed with HANDOFF_LISTENERS */
+    uint32_t kind[MAX_LISTENERS];
+};
+
+enum listener_kind {
+    LISTENER_TCP = 1,
+    LISTENER_UNIX,
+};
+
+struct listener {
+    int fd;
+    enum listener_kind kind;
+};
+
+struct listener listeners[MAX_LISTENERS];
+int nlisteners;
+int control_fd = -1;
+/* The new instance this one is handing over to */
+int handoff_fd = -1;
+atomic_bool handoff_clients;
+/* Connections ended by draining, to pass to the new instance */
+pthread_mutex_t handoff_mutex = PTHREAD_MUTEX_INITIALIZER;
+int *handoff_client_fds;
+size_t handoff_client_count;
+
+/* Traffic recording to config.record_path, trace_fd is protected by trace_mutex */
+int trace_fd = -1;
+uint32_t trace_pid;
+pthread_mutex_t trace_mutex = PTHREAD_MUTEX_INITIALIZER;
+uint64_t trace_start_ns;
+atomic_uint trace_next_conn;
 pthread_mutex_t file_mutex = PTHREAD_MUTEX_INITIALIZER;
 
+/* Load seen by admission control */
+atomic_int active_connections;
+atomic_int lock_waiters;
+struct lock_wait_avg lock_wait;
+
+/* Shedding counters, logged at most once a second while shedding and at exit */
+atomic_uint_least64_t shed_connections;
+atomic_uint_least64_t shed_busy_packets;
+atomic_uint_least64_t shed_rate_packets;
+atomic_uint_least64_t shed_last_log_ns;
+
 struct thread_info {
     pthread_t thread_id;
     int client_fd;
@@ -41,21 +247,462 @@ struct thread_info {
 };
 SLIST_HEAD(thread_list_head, thread_info) thread_list = SLIST_HEAD_INITIALIZER(thread_list);
 
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void log_shedding(bool force) {
+    uint64_t now = now_ns();
+    uint64_t last = atomic_load(&shed_last_log_ns);
+
+    if (!force && (now - last < 1000000000ULL ||
+                   !atomic_compare_exchange_strong(&shed_last_log_ns, &last, now))) {
+        return;
+    }
+    syslog(force ? LOG_INFO : LOG_WARNING,
+           "Shedding load: %llu connections refused, %llu packets busy, %llu packets rate limited,"
+           " %d active connections, %d lock waiters, average lock wait %lluus",
+           (unsigned long long)atomic_load(&shed_connections),
+           (unsigned long long)atomic_load(&shed_busy_packets),
+           (unsigned long long)atomic_load(&shed_rate_packets),
+           atomic_load(&active_connections), atomic_load(&lock_waiters),
+           (unsigned long long)lock_wait_current(&lock_wait, now) / 1000);
+}
+
+/**
+ * Take file_mutex, tracking the number of waiters and the average wait for admission control
+ */
+static void lock_file(void) {
+    uint64_t start, wait;
+
+    if (pthread_mutex_trylock(&file_mutex) == 0) {
+        wait = 0;
+    } else {
+        atomic_fetch_add(&lock_waiters, 1);
+        start = now_ns();
+        pthread_mutex_lock(&file_mutex);
+        wait = now_ns() - start;
+        atomic_fetch_sub(&lock_waiters, 1);
+    }
+    lock_wait_sample(&lock_wait, wait, now_ns());
+}
+
+/**
+ * @return true if a packet of @param len bytes on a connection with buckets @param packets and
+ * @param bytes should be stored, false if it should be answered with BUSY_REPLY
+ */
+static bool admit_packet(struct token_bucket *packets, struct token_bucket *bytes, size_t len) {
+    struct admission_limits limits = {
+        .max_lock_waiters = config.max_lock_waiters,
+        .max_lock_wait_ms = config.max_lock_wait_ms,
+    };
+
+    switch (admission_check(&limits, atomic_load(&lock_waiters), &lock_wait, packets, bytes, len,
+                            now_ns())) {
+    case SHED_BUSY:
+        atomic_fetch_add(&shed_busy_packets, 1);
+        return false;
+    case SHED_RATE:
+        atomic_fetch_add(&shed_rate_packets, 1);
+        return false;
+    default:
+        return true;
+    }
+}
+
+static void send_busy(int clientfd) {
+    send(clientfd, BUSY_REPLY, strlen(BUSY_REPLY), MSG_NOSIGNAL);
+    log_shedding(false);
+}
+
+/**
+ * Set @param name to @param value
+ * @return false with an error printed if there is no such setting or the value is invalid
+ */
+static bool set_option(const char *name, const char *value) {
+    size_t i;
+
+    for (i = 0; i < sizeof(string_settings) / sizeof(string_settings[0]); i++) {
+        if (strcmp(name, string_settings[i].name) == 0) {
+            if ((value[0] == '\0' && !string_settings[i].empty_ok) ||
+                snprintf(string_settings[i].value, string_settings[i].size, "%s", value) >=
+                (int)string_settings[i].size) {
+                fprintf(stderr, "Invalid value '%s' for %s\n", value, name);
+                return false;
+            }
+            return true;
+        }
+    }
+    for (i = 0; i < sizeof(int_settings) / sizeof(int_settings[0]); i++) {
+        if (strcmp(name, int_settings[i].name) == 0) {
+            char *end;
+            long v;
+
+            errno = 0;
+            v = strtol(value, &end, 0);
+            if (errno || end == value || *end != '\0' || v < int_settings[i].min ||
+                v > int_settings[i].max) {
+                fprintf(stderr, "Invalid value '%s' for %s\n", value, name);
+                return false;
+            }
+            *int_settings[i].value = v;
+            return true;
+        }
+    }
+    fprintf(stderr, "Unknown setting '%s'\n", name);
+    return false;
+}
+
+/**
+ * Set @param option of the form name=value
+ */
+static bool set_option_pair(const char *option) {
+    const char *eq = strchr(option, '=');
+    char name[32];
+
+    if (!eq || eq - option >= (int)sizeof(name)) {
+        fprintf(stderr, "Expected name=value, got '%s'\n", option);
+        return false;
+    }
+    memcpy(name, option, eq - option);
+    name[eq - option] = '\0';
+    return set_option(name, eq + 1);
+}
+
+static char *trim(char *s) {
+    char *end = s + strlen(s);
+
+    while (isspace((unsigned char)*s)) {
+        s++;
+    }
+    while (end > s && isspace((unsigned char)end[-1])) {
+        *--end = '\0';
+    }
+    return s;
+}
+
+/**
+ * Read settings from config file @param path, one "name = value" per line, with blank lines and
+ * lines starting with # ignored
+ */
+static bool load_config(const char *path) {
+    FILE *f = fopen(path, "r");
+    char *line = NULL;
+    size_t cap = 0;
+    int lineno = 0;
+    bool ok = true;
+
+    if (!f) {
+        fprintf(stderr, "Could not open %s: %s\n", path, strerror(errno));
+        return false;
+    }
+    while (ok && getline(&line, &cap, f) != -1) {
+        char *s = trim(line);
+        char *eq;
+
+        lineno++;
+        if (*s == '\0' || *s == '#') {
+            continue;
+        }
+        eq = strchr(s, '=');
+        if (!eq) {
+            fprintf(stderr, "%s:%d: expected name = value\n", path, lineno);
+            ok = false;
+            break;
+        }
+        *eq = '\0';
+        if (!set_option(trim(s), trim(eq + 1))) {
+            fprintf(stderr, "%s:%d: invalid setting\n", path, lineno);
+            ok = false;
+        }
+    }
+    free(line);
+    fclose(f);
+    return ok;
+}
+
+/**
+ * Start recording to config.record_path.  The trace is appended to, so an instance taking over
+ * with -u adds its records to those of the old one, with times from the same start.
+ */
+static bool trace_open(void) {
+    struct aesd_trace_header header = {
+        .magic = AESD_TRACE_MAGIC,
+        .version = AESD_TRACE_VERSION,
+        .record_size = sizeof(struct aesd_trace_record),
+    };
+    struct timespec ts;
+    uint64_t realtime_ns;
+    ssize_t rd;
+
+    trace_fd = open(config.record_path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (trace_fd < 0) {
+        fprintf(stderr, "Could not open %s: %s\n", config.record_path, strerror(errno));
+        return false;
+    }
+    clock_gettime(CLOCK_REALTIME, &ts);
+    realtime_ns = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    trace_start_ns = now_ns();
+    header.start_realtime_ns = realtime_ns;
+    rd = pread(trace_fd, &header, sizeof(header), 0);
+    if (rd == 0) {
+        if (write(trace_fd, &header, sizeof(header)) != sizeof(header)) {
+            fprintf(stderr, "Could not write %s: %s\n", config.record_path, strerror(errno));
+            goto fail;
+        }
+    } else if (rd != sizeof(header) ||
+               memcmp(header.magic, AESD_TRACE_MAGIC, sizeof(header.magic)) != 0 ||
+               header.version != AESD_TRACE_VERSION ||
+               header.record_size != sizeof(struct aesd_trace_record)) {
+        fprintf(stderr, "%s is not an aesdsocket trace of version %d\n", config.record_path,
+                AESD_TRACE_VERSION);
+        goto fail;
+    } else {
+        /* Continue the times of the existing recording, wrapping is fine as they only grow */
+        trace_start_ns -= realtime_ns - header.start_realtime_ns;
+    }
+    return true;
+
+fail:
+    close(trace_fd);
+    trace_fd = -1;
+    return false;
+}
+
+/**
+ * Record an event of @param type on connection @param conn which happened at @param time
+ * (from now_ns()), with @param len bytes of @param packet for AESD_TRACE_PACKET
+ */
+static void trace_event(uint32_t conn, enum aesd_trace_type type, uint16_t flags, uint64_t time,
+                        const char *packet, size_t len) {
+    struct aesd_trace_record record = {
+        .time_ns = time - trace_start_ns,
+        .conn = conn,
+        .pid = trace_pid,
+        .type = type,
+        .flags = flags,
+        .len = len,
+    };
+    struct iovec iov[2] = {
+        { .iov_base = &record, .iov_len = sizeof(record) },
+        { .iov_base = (void *)packet, .iov_len = len },
+    };
+
+    if (!config.record_path[0]) {
+        return;
+    }
+    if (type == AESD_TRACE_PACKET) {
+        uint64_t service_us = (now_ns() - time) / 1000;
+        record.service_us = service_us > UINT32_MAX ? UINT32_MAX : service_us;
+    }
+    /*
+     * One append per record, so records from another instance writing the same trace during an
+     * upgrade never land in the middle of one
+     */
+    pthread_mutex_lock(&trace_mutex);
+    if (trace_fd >= 0 && writev(trace_fd, iov, len ? 2 : 1) != (ssize_t)(sizeof(record) + len)) {
+        syslog(LOG_ERR, "Could not write trace %s, recording stopped", config.record_path);
+        close(trace_fd);
+        trace_fd = -1;
+    }
+    pthread_mutex_unlock(&trace_mutex);
+}
+
+static void trace_close(void) {
+    if (trace_fd >= 0) {
+        close(trace_fd);
+    }
+    trace_fd = -1;
+}
+
+static void usage(const char *prog) {
+    size_t i;
+
+    fprintf(stderr, "Usage: %s [-d] [-c config] [-p port] [-s storage_path] [-r trace]"
+            " [-u] [-o name=value]...\n"
+            "  -d  run as a daemon\n"
+            "  -c  read settings from a config file of \"name = value\" lines\n"
+            "  -p  TCP port, the same as -o port=<port>\n"
+            "  -s  storage path, the same as -o storage_path=<path>\n"
+            "  -r  record incoming traffic for aesdreplay, the same as -o record_path=<trace>\n"
+            "  -u  take the listening sockets over from the instance running with control_path\n"
+            "  -o  set any setting, options are applied in order so later ones win\n"
+            "Settings:", prog);
+    for (i = 0; i < sizeof(string_settings) / sizeof(string_settings[0]); i++) {
+        fprintf(stderr, " %s", string_settings[i].name);
+    }
+    for (i = 0; i < sizeof(int_settings) / sizeof(int_settings[0]); i++) {
+        fprintf(stderr, " %s", int_settings[i].name);
+    }
+    fprintf(stderr, "\n");
+}
+
+/**
+ * Apply the socket options of the config to client socket @param fd, which is a Unix socket
+ * unless @param tcp is set
+ */
+static void set_client_options(int fd, bool tcp) {
+    if (tcp && config.nodelay) {
+        int one = 1;
+        if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)) < 0) {
+            syslog(LOG_WARNING, "setsockopt(TCP_NODELAY) failed: %s", strerror(errno));
+        }
+    }
+}
+
+static void set_cork(int fd, bool tcp, int on) {
+    if (tcp && config.cork) {
+        setsockopt(fd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+    }
+}
+
+/**
+ * Send the rest of @param fd from its current position to @param clientfd.  sendfile() moves
+ * the data within the kernel in large chunks, which matters most on Unix sockets where every
+ * send() wakes the reader and there is no TCP_CORK to merge them.  Files which do not support
+ * it are copied through @param buffer instead.
+ */
+static void send_response(int clientfd, int fd, char *buffer, size_t buffer_size) {
+    bool copy = false;
+    ssize_t rd;
+
+    for (;;) {
+        rd = sendfile(clientfd, fd, NULL, SENDFILE_CHUNK);
+        if (rd > 0) {
+            continue;
+        }
+        if (rd < 0 && errno == EINTR) {
+            continue;
+        }
+        if (rd < 0 && (errno == EINVAL || errno == ENOSYS)) {
+            copy = true;
+        } else if (rd < 0) {
+            syslog(LOG_ERR, "sendfile() failed: %s", strerror(errno));
+        }
+        break;
+    }
+    if (!copy) {
+        return;
+    }
+
+    while ((rd = read(fd, buffer, buffer_size)) > 0) {
+        ssize_t sent = 0;
+        while (sent < rd) {
+            ssize_t s = send(clientfd, buffer + sent, rd - sent, 0);
+            if (s < 0) {
+                syslog(LOG_ERR, "send() failed: %s", strerror(errno));
+                return;
+            }
+            sent += s;
+        }
+    }
+    if (rd < 0) {
+        syslog(LOG_ERR, "read(%s) failed: %s", config.storage_path, strerror(errno));
+    }
+}
+
 void signal_handler(int sig) {
-    syslog(LOG_INFO, "Caught signal, exiting");
+    int saved_errno = errno;
+    ssize_t ret;
+
     stop_server = 1;
+    atomic_store(&draining, true);
+    ret = write(stop_pipe[1], "", 1);
+    (void)ret;
+    errno = saved_errno;
+}
+
+/**
+ * recv() from client @param fd, also waiting on stop_pipe so the connection can be ended
+ * between packets when the server stops or hands over to a new instance.  With @param partial
+ * set, part of a packet has been received and it is given drain_timeout_ms to complete.
+ * @return as recv(), with @param drained set if 0 is returned because the connection was ended
+ * between packets
+ */
+static ssize_t client_recv(int fd, char *buf, size_t len, bool partial, bool *drained) {
+    struct pollfd pfd[2] = {
+        { .fd = fd, .events = POLLIN },
+        { .fd = stop_pipe[0], .events = POLLIN },
+    };
+
+    for (;;) {
+        bool stopping = atomic_load(&draining);
+        int ready;
+
+        if (stopping && !partial) {
+            *drained = true;
+            return 0;
+        }
+        ready = poll(pfd, stopping ? 1 : 2, stopping ? config.drain_timeout_ms : -1);
+        if (ready < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (ready == 0) {
+            syslog(LOG_WARNING, "Dropping a connection with an incomplete packet");
+            return 0;
+        }
+        if (pfd[0].revents) {
+            return recv(fd, buf, len, 0);
+        }
+    }
+}
+
+/**
+ * Keep client @param fd to pass to the new instance
+ * @return false if it could not be kept and should be closed
+ */
+static bool queue_handoff(int fd) {
+    int *fds;
+
+    pthread_mutex_lock(&handoff_mutex);
+    fds = realloc(handoff_client_fds, (handoff_client_count + 1) * sizeof(*fds));
+    if (fds) {
+        handoff_client_fds = fds;
+        handoff_client_fds[handoff_client_count++] = fd;
+    }
+    pthread_mutex_unlock(&handoff_mutex);
+    return fds != NULL;
 }
 
 void* client_handler(void *arg) {
     int clientfd = *(int*)arg;
     free(arg);
 
-    char buffer[BUFFER_SIZE];
+    size_t buffer_size = config.buffer_size;
+    char *buffer = malloc(buffer_size);
     ssize_t bytes_received;
     size_t total_len = 0;
     char *packet = NULL;
+    struct token_bucket packet_bucket, byte_bucket;
+    bool drained = false;
+    uint32_t conn = atomic_fetch_add(&trace_next_conn, 1) + 1;
+    uint64_t received;
 
-    while ((bytes_received = recv(clientfd, buffer, sizeof(buffer)-1, 0)) > 0) {
+    trace_event(conn, AESD_TRACE_OPEN, 0, now_ns(), NULL, 0);
+    if (!buffer) {
+        syslog(LOG_ERR, "Could not allocate a %zu byte buffer", buffer_size);
+        close(clientfd);
+        trace_event(conn, AESD_TRACE_CLOSE, 0, now_ns(), NULL, 0);
+        atomic_fetch_sub(&active_connections, 1);
+        return NULL;
+    }
+    /* Connections passed by a previous instance may be either kind, so ask the socket */
+    int domain = AF_INET;
+    socklen_t domain_len = sizeof(domain);
+    getsockopt(clientfd, SOL_SOCKET, SO_DOMAIN, &domain, &domain_len);
+    bool tcp = domain != AF_UNIX;
+
+    set_client_options(clientfd, tcp);
+    bucket_init(&packet_bucket, config.rate_packets, config.burst_packets, now_ns());
+    bucket_init(&byte_bucket, config.rate_bytes, config.burst_bytes, now_ns());
+
+    while ((bytes_received = client_recv(clientfd, buffer, buffer_size - 1, total_len > 0,
+                                         &drained)) > 0) {
         buffer[bytes_received] = '\0';
         char *newline = strchr(buffer, '\n');
         if (!newline) {
@@ -72,13 +719,22 @@ void* client_handler(void *arg) {
         memcpy(packet + total_len, buffer, chunk_len);
         total_len += chunk_len;
         packet[total_len] = '\0';
+        received = now_ns();
 
-        pthread_mutex_lock(&file_mutex);
+        if (!admit_packet(&packet_bucket, &byte_bucket, total_len)) {
+            send_busy(clientfd);
+            trace_event(conn, AESD_TRACE_PACKET, AESD_TRACE_BUSY, received, packet, total_len);
+            free(packet);
+            packet = NULL;
+            total_len = 0;
+            continue;
+        }
+        lock_file();
 
 #if USE_AESD_CHAR_DEVICE
-        int fd = open(STORAGE_PATH, O_RDWR | O_CREAT, 0644);
+        int fd = open(config.storage_path, O_RDWR | O_CREAT, 0644);
         if (fd < 0) {
-            syslog(LOG_ERR, "open(%s) failed: %s", STORAGE_PATH, strerror(errno));
+            syslog(LOG_ERR, "open(%s) failed: %s", config.storage_path, strerror(errno));
             pthread_mutex_unlock(&file_mutex);
             break;
         }
@@ -99,72 +755,97 @@ void* client_handler(void *arg) {
         } else {
             ssize_t wlen = write(fd, packet, total_len);
             if (wlen < 0) {
-                syslog(LOG_ERR, "write(%s) failed: %s", STORAGE_PATH, strerror(errno));
+                syslog(LOG_ERR, "write(%s) failed: %s", config.storage_path, strerror(errno));
                 close(fd);
                 pthread_mutex_unlock(&file_mutex);
                 break;
             }
         }
 
-        {
-            ssize_t rd;
-            while ((rd = read(fd, buffer, sizeof(buffer))) > 0) {
-                ssize_t sent = 0;
-                while (sent < rd) {
-                    ssize_t s = send(clientfd, buffer + sent, rd - sent, 0);
-                    if (s < 0) {
-                        syslog(LOG_ERR, "send() failed: %s", strerror(errno));
-                        break;
-                    }
-                    sent += s;
-                }
-            }
-            if (rd < 0) {
-                syslog(LOG_ERR, "read(%s) failed: %s", STORAGE_PATH, strerror(errno));
-            }
-        }
-
+        set_cork(clientfd, tcp, 1);
+        send_response(clientfd, fd, buffer, buffer_size);
+        set_cork(clientfd, tcp, 0);
         close(fd);
 
 #else
 
-        int fd = open(STORAGE_PATH, O_RDWR | O_CREAT | O_APPEND, 0644);
+        int fd = open(config.storage_path, O_RDWR | O_CREAT | O_APPEND, 0644);
         if (fd < 0) {
-            syslog(LOG_ERR, "open(%s) failed: %s", STORAGE_PATH, strerror(errno));
+            syslog(LOG_ERR, "open(%s) failed: %s", config.storage_path, strerror(errno));
             pthread_mutex_unlock(&file_mutex);
             break;
         }
         write(fd, packet, total_len);
         lseek(fd, 0, SEEK_SET);
-        ssize_t rd;
-        while ((rd = read(fd, buffer, sizeof(buffer))) > 0) {
-            send(clientfd, buffer, rd, 0);
-        }
+        set_cork(clientfd, tcp, 1);
+        send_response(clientfd, fd, buffer, buffer_size);
+        set_cork(clientfd, tcp, 0);
         close(fd);
 #endif
 
         pthread_mutex_unlock(&file_mutex);
+        trace_event(conn, AESD_TRACE_PACKET, 0, received, packet, total_len);
         free(packet);
         packet = NULL;
         total_len = 0;
     }
 
     free(packet);
-    close(clientfd);
+    free(buffer);
+    if (!drained || !atomic_load(&handoff_clients) || !queue_handoff(clientfd)) {
+        close(clientfd);
+    }
+    trace_event(conn, AESD_TRACE_CLOSE, 0, now_ns(), NULL, 0);
+    atomic_fetch_sub(&active_connections, 1);
     return NULL;
 }
 
-int main(int argc, char *argv[]) {
-    bool daemon_mode = false;
-    if (argc > 1 && strcmp(argv[1], "-d") == 0) {
-        daemon_mode = true;
+static void start_client(int fd) {
+    int *fd_ptr = malloc(sizeof(*fd_ptr));
+    struct thread_info *node = malloc(sizeof(*node));
+    int err;
+
+    if (!fd_ptr || !node) {
+        syslog(LOG_ERR, "Out of memory for a new connection");
+        free(fd_ptr);
+        free(node);
+        close(fd);
+        return;
+    }
+    *fd_ptr = fd;
+    node->client_fd = fd;
+    atomic_fetch_add(&active_connections, 1);
+    err = pthread_create(&node->thread_id, NULL, client_handler, fd_ptr);
+    if (err) {
+        syslog(LOG_ERR, "pthread_create() failed: %s", strerror(err));
+        atomic_fetch_sub(&active_connections, 1);
+        free(fd_ptr);
+        free(node);
+        close(fd);
+        return;
     }
+    SLIST_INSERT_HEAD(&thread_list, node, entries);
+}
 
-    signal(SIGINT, signal_handler);
-    signal(SIGTERM, signal_handler);
-    openlog("aesdsocket", LOG_PID | LOG_CONS, LOG_USER);
+static void accept_client(int listen_fd) {
+    /* Client threads use blocking I/O, so only close on exec is set */
+    int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+
+    if (fd < 0) {
+        return;
+    }
+    if (config.max_connections &&
+        atomic_load(&active_connections) >= config.max_connections) {
+        atomic_fetch_add(&shed_connections, 1);
+        send_busy(fd);
+        close(fd);
+        return;
+    }
+    start_client(fd);
+}
 
-    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+static int open_tcp_listener(void) {
+    int sockfd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
     if (sockfd < 0) {
         syslog(LOG_ERR, "socket() failed: %s", strerror(errno));
         return -1;
@@ -172,11 +853,20 @@ int main(int argc, char *argv[]) {
 
     int yes = 1;
     setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+    /* Accepted sockets inherit these, and the receive window is chosen before listen() */
+    if (config.rcvbuf &&
+        setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &config.rcvbuf, sizeof(config.rcvbuf)) < 0) {
+        syslog(LOG_WARNING, "setsockopt(SO_RCVBUF) failed: %s", strerror(errno));
+    }
+    if (config.sndbuf &&
+        setsockopt(sockfd, SOL_SOCKET, SO_SNDBUF, &config.sndbuf, sizeof(config.sndbuf)) < 0) {
+        syslog(LOG_WARNING, "setsockopt(SO_SNDBUF) failed: %s", strerror(errno));
+    }
 
     struct sockaddr_in serv = {0};
     serv.sin_family = AF_INET;
     serv.sin_addr.s_addr = INADDR_ANY;
-    serv.sin_port = htons(PORT);
+    serv.sin_port = htons(config.port);
 
     if (bind(sockfd, (struct sockaddr*)&serv, sizeof(serv)) < 0) {
         syslog(LOG_ERR, "bind() failed: %s", strerror(errno));
@@ -184,11 +874,435 @@ int main(int argc, char *argv[]) {
         return -1;
     }
 
-    if (listen(sockfd, BACKLOG) < 0) {
+    if (listen(sockfd, config.backlog) < 0) {
         syslog(LOG_ERR, "listen() failed: %s", strerror(errno));
         close(sockfd);
         return -1;
     }
+    return sockfd;
+}
+
+static bool unix_address(const char *path, struct sockaddr_un *addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        syslog(LOG_ERR, "Socket path %s is too long", path);
+        return false;
+    }
+    strcpy(addr->sun_path, path);
+    return true;
+}
+
+/**
+ * Listen for local clients on config.unix_path, with the same protocol as over TCP
+ * @return the listening socket or -1
+ */
+static int open_unix_listener(void) {
+    struct sockaddr_un addr;
+    int fd;
+
+    if (!unix_address(config.unix_path, &addr)) {
+        return -1;
+    }
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    if (fd < 0) {
+        syslog(LOG_ERR, "socket(AF_UNIX) failed: %s", strerror(errno));
+        return -1;
+    }
+    if (config.rcvbuf) {
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &config.rcvbuf, sizeof(config.rcvbuf));
+    }
+    if (config.sndbuf) {
+        setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &config.sndbuf, sizeof(config.sndbuf));
+    }
+    /* The TCP port is bound first, so a socket left here is not in use by another instance */
+    unlink(config.unix_path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, config.backlog) < 0) {
+        syslog(LOG_ERR, "Could not listen on %s: %s", config.unix_path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static bool has_listener(enum listener_kind kind) {
+    int i;
+
+    for (i = 0; i < nlisteners; i++) {
+        if (listeners[i].kind == kind) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * @return false if listeners[] is full
+ */
+static bool add_listener(int fd, enum listener_kind kind) {
+    if (nlisteners == MAX_LISTENERS) {
+        return false;
+    }
+    listeners[nlisteners].fd = fd;
+    listeners[nlisteners].kind = kind;
+    nlisteners++;
+    return true;
+}
+
+/**
+ * Close listening socket @param l, removing the path of a Unix socket
+ */
+static void close_listener(const struct listener *l) {
+    if (l->kind == LISTENER_UNIX) {
+        /* Ask the socket, it may have been created by an instance with a different config */
+        struct sockaddr_un addr;
+        socklen_t len = sizeof(addr);
+        if (getsockname(l->fd, (struct sockaddr *)&addr, &len) == 0 &&
+            len > offsetof(struct sockaddr_un, sun_path) && addr.sun_path[0]) {
+            unlink(addr.sun_path);
+        }
+    }
+    close(l->fd);
+}
+
+/**
+ * Send @param msg with the @param nfds file descriptors at @param fds
+ */
+static bool send_fds(int sock, const struct handoff_msg *msg, const int *fds, size_t nfds) {
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * HANDOFF_MAX_FDS)];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov = { .iov_base = (void *)msg, .iov_len = sizeof(*msg) };
+    struct msghdr mh = { .msg_iov = &iov, .msg_iovlen = 1 };
+
+    if (nfds) {
+        struct cmsghdr *cmsg;
+
+        memset(&control, 0, sizeof(control));
+        mh.msg_control = control.buf;
+        mh.msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
+        cmsg = CMSG_FIRSTHDR(&mh);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * nfds);
+    }
+    return sendmsg(sock, &mh, MSG_NOSIGNAL) == sizeof(*msg);
+}
+
+/**
+ * Receive a message into @param msg and its file descriptors into @param fds, which has room
+ * for HANDOFF_MAX_FDS
+ * @return 1 on success, 0 at the end of the stream and -1 on error
+ */
+static int recv_fds(int sock, struct handoff_msg *msg, int *fds) {
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * HANDOFF_MAX_FDS)];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov = { .iov_base = msg, .iov_len = sizeof(*msg) };
+    struct msghdr mh = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+        .msg_controllen = sizeof(control.buf),
+    };
+    struct cmsghdr *cmsg;
+    size_t nfds = 0;
+    ssize_t n;
+
+    n = recvmsg(sock, &mh, MSG_CMSG_CLOEXEC);
+    if (n <= 0) {
+        return n;
+    }
+    for (cmsg = CMSG_FIRSTHDR(&mh); cmsg; cmsg = CMSG_NXTHDR(&mh, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            if (nfds + count > HANDOFF_MAX_FDS) {
+                count = HANDOFF_MAX_FDS - nfds;
+            }
+            memcpy(fds + nfds, CMSG_DATA(cmsg), count * sizeof(int));
+            nfds += count;
+        }
+    }
+    if (n != sizeof(*msg) || msg->count != nfds || (mh.msg_flags & MSG_CTRUNC)) {
+        syslog(LOG_ERR, "Malformed handoff message");
+        while (nfds) {
+            close(fds[--nfds]);
+        }
+        return -1;
+    }
+    return 1;
+}
+
+/**
+ * Create the control socket at config.control_path for a later upgrade to take this instance's
+ * listening sockets over
+ */
+static void open_control(void) {
+    struct sockaddr_un addr;
+    int fd;
+
+    if (!config.control_path[0] || !unix_address(config.control_path, &addr)) {
+        return;
+    }
+    fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    if (fd < 0) {
+        syslog(LOG_WARNING, "socket(AF_UNIX) failed: %s", strerror(errno));
+        return;
+    }
+    /* Any previous instance has either exited or handed over to this one */
+    unlink(config.control_path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        chmod(config.control_path, 0600) < 0 || listen(fd, 1) < 0) {
+        syslog(LOG_WARNING, "Control socket %s not available, upgrades are disabled: %s",
+               config.control_path, strerror(errno));
+        close(fd);
+        return;
+    }
+    control_fd = fd;
+}
+
+/**
+ * Take the listening sockets over from the instance running with control socket
+ * config.control_path, see struct handoff_msg
+ * @return the connection to the running instance, which later passes the client connections,
+ * or -1 on failure
+ */
+static int take_over(void) {
+    struct handoff_msg msg = { .type = HANDOFF_REQUEST };
+    struct timeval timeout = { .tv_sec = 10 };
+    int fds[HANDOFF_MAX_FDS];
+    struct sockaddr_un addr;
+    uint32_t i;
+    bool ok;
+    int fd;
+
+    if (!config.control_path[0] || !unix_address(config.control_path, &addr)) {
+        fprintf(stderr, "No control socket to take over from\n");
+        return -1;
+    }
+    fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        fprintf(stderr, "Could not connect to %s: %s\n", config.control_path, strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    if (config.handoff_clients) {
+        msg.flags |= HANDOFF_WANT_CLIENTS;
+    }
+    if (!send_fds(fd, &msg, NULL, 0) || recv_fds(fd, &msg, fds) != 1) {
+        fprintf(stderr, "The running instance did not hand over its listening sockets\n");
+        close(fd);
+        return -1;
+    }
+    /* A running instance has at most one listening socket of each kind */
+    ok = msg.type == HANDOFF_LISTENERS && msg.count <= MAX_LISTENERS;
+    for (i = 0; ok && i < msg.count; i++) {
+        ok = (msg.kind[i] == LISTENER_TCP || msg.kind[i] == LISTENER_UNIX) &&
+             !has_listener(msg.kind[i]) && add_listener(fds[i], msg.kind[i]);
+    }
+    if (!ok) {
+        /* Rather than start with only some of them */
+        fprintf(stderr, "The running instance passed invalid listening sockets\n");
+        for (i = 0; i < msg.count; i++) {
+            close(fds[i]);
+        }
+        nlisteners = 0;
+        close(fd);
+        return -1;
+    }
+    timeout.tv_sec = 0;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    syslog(LOG_INFO, "Took over %d listening sockets from %s", nlisteners, config.control_path);
+    return fd;
+}
+
+/**
+ * Answer an upgrade request on the control socket by passing the listening sockets
+ * @return true if they were handed over, after which this instance stops accepting and drains
+ */
+static bool hand_over(void) {
+    struct handoff_msg msg;
+    struct timeval timeout = { .tv_sec = 1 };
+    int fds[HANDOFF_MAX_FDS];
+    struct ucred cred = { .pid = 0 };
+    socklen_t cred_len = sizeof(cred);
+    bool want_clients;
+    int conn, i;
+
+    conn = accept4(control_fd, NULL, NULL, SOCK_CLOEXEC);
+    if (conn < 0) {
+        return false;
+    }
+    setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len);
+    if (recv_fds(conn, &msg, fds) != 1 || msg.type != HANDOFF_REQUEST || msg.count != 0) {
+        syslog(LOG_WARNING, "Ignoring an invalid request on the control socket");
+        close(conn);
+        return false;
+    }
+
+    want_clients = (msg.flags & HANDOFF_WANT_CLIENTS) != 0;
+    memset(&msg, 0, sizeof(msg));
+    msg.type = HANDOFF_LISTENERS;
+    msg.count = nlisteners;
+    for (i = 0; i < nlisteners; i++) {
+        fds[i] = listeners[i].fd;
+        msg.kind[i] = listeners[i].kind;
+    }
+    if (!send_fds(conn, &msg, fds, nlisteners)) {
+        syslog(LOG_ERR, "Could not hand over to pid %d: %s", (int)cred.pid, strerror(errno));
+        close(conn);
+        return false;
+    }
+    syslog(LOG_INFO, "Handed over %d listening sockets to pid %d, draining", nlisteners,
+           (int)cred.pid);
+    for (i = 0; i < nlisteners; i++) {
+        close(listeners[i].fd);
+    }
+    nlisteners = 0;
+    handoff_fd = conn;
+    atomic_store(&handoff_clients, want_clients);
+    return true;
+}
+
+/**
+ * Pass the connections collected by queue_handoff() to the new instance
+ */
+static void hand_over_clients(void) {
+    struct handoff_msg msg = { .type = HANDOFF_CLIENTS };
+    size_t done = 0, sent = 0;
+
+    while (done < handoff_client_count) {
+        size_t count = handoff_client_count - done;
+        if (count > HANDOFF_MAX_FDS) {
+            count = HANDOFF_MAX_FDS;
+        }
+        msg.count = count;
+        if (send_fds(handoff_fd, &msg, handoff_client_fds + done, count)) {
+            sent += count;
+        }
+        done += count;
+    }
+    for (done = 0; done < handoff_client_count; done++) {
+        close(handoff_client_fds[done]);
+    }
+    syslog(LOG_INFO, "Handed over %zu of %zu connections", sent, handoff_client_count);
+    free(handoff_client_fds);
+    handoff_client_fds = NULL;
+    handoff_client_count = 0;
+}
+
+/**
+ * Serve the connections passed by the instance this one took over from on @param fd
+ * @return false once it has finished and @param fd is closed
+ */
+static bool receive_clients(int fd) {
+    struct handoff_msg msg;
+    int fds[HANDOFF_MAX_FDS];
+    uint32_t i;
+    int ret = recv_fds(fd, &msg, fds);
+
+    if (ret <= 0) {
+        close(fd);
+        return false;
+    }
+    for (i = 0; i < msg.count; i++) {
+        if (msg.type == HANDOFF_CLIENTS) {
+            start_client(fds[i]);
+        } else {
+            close(fds[i]);
+        }
+    }
+    return true;
+}
+
+int main(int argc, char *argv[]) {
+    bool daemon_mode = false;
+    bool upgrade = false;
+    bool handed_over = false;
+    int upgrade_fd = -1;
+    struct sigaction sa = { .sa_handler = signal_handler };
+    int opt, i;
+
+    while ((opt = getopt(argc, argv, "dc:p:s:r:o:uh")) != -1) {
+        bool ok = true;
+        switch (opt) {
+        case 'd':
+            daemon_mode = true;
+            break;
+        case 'c':
+            ok = load_config(optarg);
+            break;
+        case 'p':
+            ok = set_option("port", optarg);
+            break;
+        case 's':
+            ok = set_option("storage_path", optarg);
+            break;
+        case 'r':
+            ok = set_option("record_path", optarg);
+            break;
+        case 'o':
+            ok = set_option_pair(optarg);
+            break;
+        case 'u':
+            upgrade = true;
+            break;
+        default:
+            ok = false;
+            break;
+        }
+        if (!ok) {
+            usage(argv[0]);
+            return -1;
+        }
+    }
+    if (optind < argc) {
+        usage(argv[0]);
+        return -1;
+    }
+    if (config.record_path[0] && !trace_open()) {
+        return -1;
+    }
+
+    /* No SA_RESTART, so poll() in the accept loop returns on a signal */
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+    openlog("aesdsocket", LOG_PID | LOG_CONS, LOG_USER);
+
+    if (pipe2(stop_pipe, O_CLOEXEC | O_NONBLOCK) < 0) {
+        syslog(LOG_ERR, "pipe2() failed: %s", strerror(errno));
+        return -1;
+    }
+    if (upgrade) {
+        upgrade_fd = take_over();
+        if (upgrade_fd < 0) {
+            return -1;
+        }
+    }
+    /* Open whatever the instance taken over from did not pass */
+    if (!has_listener(LISTENER_TCP)) {
+        int sockfd = open_tcp_listener();
+        if (sockfd < 0) {
+            return -1;
+        }
+        add_listener(sockfd, LISTENER_TCP);
+    }
+    if (config.unix_path[0] && !has_listener(LISTENER_UNIX)) {
+        int sockfd = open_unix_listener();
+        if (sockfd >= 0) {
+            add_listener(sockfd, LISTENER_UNIX);
+        }
+    }
+    open_control();
 
     if (daemon_mode) {
         pid_t pid = fork();
@@ -198,23 +1312,44 @@ int main(int argc, char *argv[]) {
         close(STDOUT_FILENO);
         close(STDERR_FILENO);
     }
+    trace_pid = getpid();
 
     SLIST_INIT(&thread_list);
-    while (!stop_server) {
-        int *clientfd_ptr = malloc(sizeof(int));
-        if (!clientfd_ptr) continue;
-        *clientfd_ptr = accept(sockfd, NULL, NULL);
-        if (*clientfd_ptr < 0) {
-            free(clientfd_ptr);
-            if (stop_server) break;
+    while (!stop_server && !handed_over) {
+        struct pollfd pfd[MAX_LISTENERS + 3];
+        int n = 0;
+
+        for (i = 0; i < nlisteners; i++) {
+            pfd[n++] = (struct pollfd) { .fd = listeners[i].fd, .events = POLLIN };
+        }
+        pfd[n++] = (struct pollfd) { .fd = stop_pipe[0], .events = POLLIN };
+        pfd[n++] = (struct pollfd) { .fd = control_fd, .events = POLLIN };
+        pfd[n++] = (struct pollfd) { .fd = upgrade_fd, .events = POLLIN };
+
+        if (poll(pfd, n, -1) < 0) {
             continue;
         }
-        struct thread_info *node = malloc(sizeof(*node));
-        node->client_fd = *clientfd_ptr;
-        pthread_create(&node->thread_id, NULL, client_handler, clientfd_ptr);
-        SLIST_INSERT_HEAD(&thread_list, node, entries);
+        for (i = 0; i < nlisteners; i++) {
+            if (pfd[i].revents & POLLIN) {
+                accept_client(listeners[i].fd);
+            }
+        }
+        if (pfd[n - 1].revents && !receive_clients(upgrade_fd)) {
+            upgrade_fd = -1;
+        }
+        if (pfd[n - 2].revents & POLLIN) {
+            handed_over = hand_over();
+        }
+    }
+    if (stop_server) {
+        syslog(LOG_INFO, "Caught signal, exiting");
     }
 
+    /* Let every client thread finish its current packet, then wait for them */
+    atomic_store(&draining, true);
+    if (write(stop_pipe[1], "", 1) < 0 && errno != EAGAIN) {
+        syslog(LOG_ERR, "write() to the stop pipe failed: %s", strerror(errno));
+    }
     struct thread_info *np;
     while (!SLIST_EMPTY(&thread_list)) {
         np = SLIST_FIRST(&thread_list);
@@ -223,7 +1358,30 @@ int main(int argc, char *argv[]) {
         free(np);
     }
 
-    close(sockfd);
+    if (handoff_fd >= 0) {
+        if (atomic_load(&handoff_clients)) {
+            hand_over_clients();
+        }
+        close(handoff_fd);
+    }
+    if (upgrade_fd >= 0) {
+        close(upgrade_fd);
+    }
+    for (i = 0; i < nlisteners; i++) {
+        close_listener(&listeners[i]);
+    }
+    if (control_fd >= 0) {
+        close(control_fd);
+        /* After handing over, the path belongs to the new instance */
+        if (!handed_over) {
+            unlink(config.control_path);
+        }
+    }
+    trace_close();
+    if (atomic_load(&shed_connections) || atomic_load(&shed_busy_packets) ||
+        atomic_load(&shed_rate_packets)) {
+        log_shedding(true);
+    }
     closelog();
     return 0;
 }
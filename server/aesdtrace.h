@@ -0,0 +1,54 @@
+#ifndef AESDTRACE_H
+#define AESDTRACE_H
+
+#include <stdint.h>
+
+/**
+ * Format of the traffic traces written by "aesdsocket -r <file>" and read by aesdreplay.
+ *
+ * A trace is a struct aesd_trace_header followed by records.  Each record is a
+ * struct aesd_trace_record, followed for AESD_TRACE_PACKET by the len bytes of the packet as
+ * the server processed it, newline included.  Records of one connection appear in the order
+ * they happened, records of different connections may be interleaved in any order.
+ * aesdsocket appends to an existing trace, so a trace may hold the records of an instance and
+ * of the one that took over from it with -u, told apart by pid and sharing the start time.
+ * All fields are in the byte order of the recording host.
+ */
+
+#define AESD_TRACE_MAGIC   "AESDTRC1"
+#define AESD_TRACE_VERSION 2
+
+struct aesd_trace_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+    /* Wall clock time the recording started, in ns since the epoch */
+    uint64_t start_realtime_ns;
+};
+
+enum aesd_trace_type {
+    AESD_TRACE_OPEN = 1,
+    AESD_TRACE_PACKET,
+    AESD_TRACE_CLOSE,
+};
+
+/* The packet was answered with BUSY rather than stored */
+#define AESD_TRACE_BUSY 0x1
+
+struct aesd_trace_record {
+    /* When the connection was accepted or closed, or the whole packet received, in ns since
+     * the start of the recording */
+    uint64_t time_ns;
+    /* Connections are numbered from 1 by each server process */
+    uint32_t conn;
+    uint32_t pid;
+    uint16_t type;
+    uint16_t flags;
+    /* Length of the packet following the record, 0 for the other types */
+    uint32_t len;
+    /* Time from receiving the packet to having sent the response, in us */
+    uint32_t service_us;
+    uint32_t reserved;
+};
+
+#endif /* AESDTRACE_H */
@@ -0,0 +1,124 @@
+#include "unity.h"
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "../../examples/systemcalls/systemcalls.h"
+
+/**
+ * Tests for the posix_spawn based do_exec_redirect(), do_exec_many() and do_exec_capture()
+ */
+
+#define EXEC_MANY_OUTPUT "/tmp/exec_many_test.txt"
+
+static double elapsed_seconds(const struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+void test_exec_redirect_posix_spawn()
+{
+    char buffer[64] = { 0 };
+    FILE *file;
+
+    TEST_ASSERT_TRUE_MESSAGE(do_exec_redirect(EXEC_MANY_OUTPUT, 2, "/bin/echo", "spawned"),
+            "do_exec_redirect should write the output of /bin/echo to the file");
+    file = fopen(EXEC_MANY_OUTPUT, "r");
+    TEST_ASSERT_NOT_NULL(file);
+    TEST_ASSERT_NOT_NULL(fgets(buffer, sizeof(buffer), file));
+    fclose(file);
+    remove(EXEC_MANY_OUTPUT);
+    TEST_ASSERT_EQUAL_STRING("spawned\n", buffer);
+
+    TEST_ASSERT_FALSE_MESSAGE(do_exec(1, "/nonexistent/command"),
+            "do_exec should fail for a command which cannot be executed");
+}
+
+void test_exec_many_statuses()
+{
+    char *const ok[] = { "/bin/true", NULL };
+    char *const fail[] = { "/bin/sh", "-c", "exit 3", NULL };
+    char *const missing[] = { "/nonexistent/command", NULL };
+    struct exec_cmd cmds[] = {
+        { .argv = ok },
+        { .argv = fail },
+        { .argv = missing },
+        { .argv = ok },
+    };
+
+    TEST_ASSERT_FALSE(do_exec_many(cmds, 4, 2));
+    TEST_ASSERT_EQUAL_INT(0, cmds[0].status);
+    TEST_ASSERT_EQUAL_INT(3, cmds[1].status);
+    TEST_ASSERT_EQUAL_INT(-1, cmds[2].status);
+    TEST_ASSERT_EQUAL_INT(0, cmds[3].status);
+
+    TEST_ASSERT_TRUE(do_exec_many(cmds, 1, 0));
+    TEST_ASSERT_TRUE(do_exec_many(cmds, 0, 0));
+}
+
+void test_exec_many_runs_in_parallel()
+{
+    char *const sleeper[] = { "/bin/sleep", "0.3", NULL };
+    struct exec_cmd cmds[8];
+    struct timespec start;
+    double elapsed;
+    size_t i;
+
+    for (i = 0; i < 8; i++) {
+        cmds[i].argv = sleeper;
+        cmds[i].outputfile = NULL;
+        cmds[i].status = -1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    TEST_ASSERT_TRUE(do_exec_many(cmds, 8, 4));
+    elapsed = elapsed_seconds(&start);
+    /* Two rounds of four, allowing plenty of slack for a loaded machine */
+    TEST_ASSERT_TRUE_MESSAGE(elapsed >= 0.55 && elapsed < 1.8,
+            "8 commands of 0.3s with 4 in parallel should take about 0.6s");
+    for (i = 0; i < 8; i++) {
+        TEST_ASSERT_EQUAL_INT(0, cmds[i].status);
+    }
+}
+
+void test_exec_capture_output()
+{
+    struct exec_capture capture;
+
+    TEST_ASSERT_TRUE(do_exec_capture(&capture, 0, -1, 3, "/bin/sh", "-c", "echo out; echo err >&2"));
+    TEST_ASSERT_EQUAL_INT(0, capture.status);
+    TEST_ASSERT_EQUAL_STRING("out\n", capture.out);
+    TEST_ASSERT_EQUAL_INT(4, capture.out_len);
+    TEST_ASSERT_EQUAL_STRING("err\n", capture.err);
+    TEST_ASSERT_FALSE(capture.truncated);
+    TEST_ASSERT_FALSE(capture.timed_out);
+    exec_capture_free(&capture);
+
+    TEST_ASSERT_FALSE(do_exec_capture(&capture, 0, -1, 3, "/bin/sh", "-c", "exit 2"));
+    TEST_ASSERT_EQUAL_INT(2, capture.status);
+    TEST_ASSERT_NULL(capture.out);
+    exec_capture_free(&capture);
+}
+
+void test_exec_capture_limits()
+{
+    struct exec_capture capture;
+    struct timespec start;
+
+    /* 100000 bytes of output, more than a pipe holds, limited to 1000 */
+    TEST_ASSERT_TRUE(do_exec_capture(&capture, 1000, -1, 3, "/bin/sh", "-c",
+            "head -c 100000 /dev/zero"));
+    TEST_ASSERT_EQUAL_INT(1000, capture.out_len);
+    TEST_ASSERT_TRUE(capture.truncated);
+    exec_capture_free(&capture);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    TEST_ASSERT_FALSE(do_exec_capture(&capture, 0, 200, 2, "/bin/sleep", "5"));
+    TEST_ASSERT_TRUE(capture.timed_out);
+    TEST_ASSERT_EQUAL_INT(-1, capture.status);
+    TEST_ASSERT_TRUE_MESSAGE(elapsed_seconds(&start) < 2.0,
+            "The command should be killed at the timeout");
+    exec_capture_free(&capture);
+}
@@ -0,0 +1,42 @@
+#include "unity.h"
+#include <stdbool.h>
+#include <string.h>
+#include "../../examples/threading/locklab.h"
+
+/**
+ * Tests for the lock types in examples/threading/locklab.c
+ */
+
+void test_locklab_mutual_exclusion()
+{
+    struct locklab_config config = {
+        .threads = 3,
+        .hold_ns = 200,
+        .think_ns = 200,
+        .duration_ms = 50,
+        .read_percent = 50,
+    };
+    struct locklab_result result;
+    int type;
+
+    for (type = 0; type < LOCKLAB_TYPES; type++) {
+        config.type = type;
+        TEST_ASSERT_TRUE_MESSAGE(locklab_run(&config, &result), locklab_type_name(type));
+        TEST_ASSERT_TRUE_MESSAGE(result.mutual_exclusion_ok, locklab_type_name(type));
+        TEST_ASSERT_TRUE_MESSAGE(result.total_ops > 0, locklab_type_name(type));
+        TEST_ASSERT_TRUE_MESSAGE(result.min_thread_ops <= result.max_thread_ops, locklab_type_name(type));
+        TEST_ASSERT_TRUE_MESSAGE(result.fairness > 0.0 && result.fairness <= 1.0 + 1e-9,
+                locklab_type_name(type));
+        TEST_ASSERT_TRUE_MESSAGE(result.p50_ns <= result.p99_ns, locklab_type_name(type));
+    }
+}
+
+void test_locklab_parse_type()
+{
+    enum locklab_type type;
+
+    TEST_ASSERT_TRUE(locklab_parse_type("ticket", &type));
+    TEST_ASSERT_EQUAL_INT(LOCKLAB_TICKET, type);
+    TEST_ASSERT_EQUAL_STRING("futex", locklab_type_name(LOCKLAB_FUTEX));
+    TEST_ASSERT_FALSE(locklab_parse_type("semaphore", &type));
+}
@@ -0,0 +1,91 @@
+#include "unity.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include "../../server/aesdadmission.h"
+
+/**
+ * Tests for the admission control measurements in server/aesdadmission.c
+ */
+
+#define MS 1000000ULL
+
+void test_lock_wait_recovers_after_spike()
+{
+    struct lock_wait_avg avg = { 0 };
+    uint64_t now = 1000 * MS;
+    int i;
+
+    for (i = 0; i < 32; i++) {
+        lock_wait_sample(&avg, 1000 * MS, now);
+    }
+    TEST_ASSERT_TRUE(lock_wait_current(&avg, now) > 250 * MS);
+
+    /*
+     * Everything is shed while the average is high, so no sample follows the spike and the
+     * average has to come down by itself
+     */
+    TEST_ASSERT_TRUE(lock_wait_current(&avg, now + LOCK_WAIT_HALF_LIFE_NS) <
+                     lock_wait_current(&avg, now));
+    TEST_ASSERT_TRUE(lock_wait_current(&avg, now + 10 * LOCK_WAIT_HALF_LIFE_NS) < 5 * MS);
+    TEST_ASSERT_TRUE(lock_wait_current(&avg, now + 100 * LOCK_WAIT_HALF_LIFE_NS) == 0);
+
+    /* A sample after the quiet period starts from the decayed average */
+    now += 100 * LOCK_WAIT_HALF_LIFE_NS;
+    lock_wait_sample(&avg, 0, now);
+    TEST_ASSERT_TRUE(lock_wait_current(&avg, now) == 0);
+}
+
+void test_buckets_check_both_before_charging()
+{
+    struct token_bucket packets, bytes;
+    uint64_t now = 1000 * MS;
+
+    bucket_init(&packets, 10, 10, now);
+    bucket_init(&bytes, 100, 100, now);
+
+    /* A packet larger than the burst is let through into debt, then nothing until refilled */
+    TEST_ASSERT_TRUE(buckets_take(&packets, &bytes, 300, now));
+    TEST_ASSERT_FALSE(buckets_take(&packets, &bytes, 1, now));
+    TEST_ASSERT_FALSE(buckets_take(&packets, &bytes, 1, now));
+    /* The rejected packets did not use up packet tokens */
+    TEST_ASSERT_TRUE(packets.tokens > 8.99 && packets.tokens < 9.01);
+
+    /* 200 bytes of debt take 2 seconds to repay at 100 bytes per second */
+    TEST_ASSERT_FALSE(buckets_take(&packets, &bytes, 1, now + 1500 * MS));
+    TEST_ASSERT_TRUE(buckets_take(&packets, &bytes, 1, now + 2500 * MS));
+}
+
+void test_buckets_without_rate_never_limit()
+{
+    struct token_bucket packets, bytes;
+    int i;
+
+    bucket_init(&packets, 0, 0, 0);
+    bucket_init(&bytes, 0, 0, 0);
+    for (i = 0; i < 1000; i++) {
+        TEST_ASSERT_TRUE(buckets_take(&packets, &bytes, 1 << 20, 0));
+    }
+}
+
+void test_busy_packets_keep_their_tokens()
+{
+    struct admission_limits limits = { .max_lock_waiters = 4 };
+    struct lock_wait_avg avg = { 0 };
+    struct token_bucket packets, bytes;
+    uint64_t now = 1000 * MS;
+    int i;
+
+    bucket_init(&packets, 10, 10, now);
+    bucket_init(&bytes, 1000, 1000, now);
+    for (i = 0; i < 100; i++) {
+        TEST_ASSERT_TRUE(admission_check(&limits, 4, &avg, &packets, &bytes, 100, now) ==
+                         SHED_BUSY);
+    }
+    TEST_ASSERT_TRUE(packets.tokens > 9.99 && packets.tokens < 10.01);
+    TEST_ASSERT_TRUE(bytes.tokens > 999.99 && bytes.tokens < 1000.01);
+
+    /* Once the lock is free again the packet is admitted and charged */
+    TEST_ASSERT_TRUE(admission_check(&limits, 3, &avg, &packets, &bytes, 100, now) == ADMIT);
+    TEST_ASSERT_TRUE(packets.tokens > 8.99 && packets.tokens < 9.01);
+    TEST_ASSERT_TRUE(bytes.tokens > 899.99 && bytes.tokens < 900.01);
+}
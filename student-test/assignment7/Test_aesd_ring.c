@@ -0,0 +1,117 @@
+#include "unity.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sched.h>
+#include "../../aesd-char-driver/aesd-ring.h"
+
+/**
+ * Tests for the lock-free rings in aesd-ring.h
+ */
+
+#define RING_TEST_PRODUCERS 4
+#define RING_TEST_PER_PRODUCER 20000
+
+static struct aesd_mpsc_ring mpsc_ring;
+
+/**
+ * Encode producer and sequence in the entry so the consumer can check ordering without
+ * allocating a buffer per entry
+ */
+static struct aesd_buffer_entry make_entry(size_t producer, size_t seq)
+{
+    struct aesd_buffer_entry entry = {
+        .buffptr = (const char *)(uintptr_t)(producer + 1),
+        .size = seq,
+    };
+    return entry;
+}
+
+void test_aesd_spsc_ring_order_and_full()
+{
+    struct aesd_spsc_ring ring;
+    struct aesd_buffer_entry entries[8];
+    struct aesd_buffer_entry out;
+    size_t i;
+
+    TEST_ASSERT_TRUE(aesd_spsc_ring_init(&ring, 5));
+    for (i = 0; i < 8; i++) {
+        entries[i] = make_entry(0, i);
+    }
+
+    TEST_ASSERT_FALSE_MESSAGE(aesd_spsc_ring_pop(&ring, &out), "Pop from an empty ring should fail");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(8, aesd_spsc_ring_push_batch(&ring, entries, 8),
+            "Capacity should be rounded up to a power of two");
+    TEST_ASSERT_FALSE_MESSAGE(aesd_spsc_ring_push(&ring, &entries[0]), "Push to a full ring should fail");
+
+    TEST_ASSERT_EQUAL_INT(3, aesd_spsc_ring_pop_batch(&ring, entries, 3));
+    TEST_ASSERT_EQUAL_INT(0, entries[0].size);
+    TEST_ASSERT_EQUAL_INT(2, entries[2].size);
+    TEST_ASSERT_TRUE(aesd_spsc_ring_push(&ring, &entries[0]));
+    TEST_ASSERT_EQUAL_INT_MESSAGE(6, aesd_spsc_ring_pop_batch(&ring, entries, 8),
+            "Batch pop should return every remaining entry");
+    TEST_ASSERT_EQUAL_INT(3, entries[0].size);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, entries[5].size, "Wrapped entry should be popped last");
+
+    aesd_spsc_ring_destroy(&ring);
+}
+
+static void *mpsc_producer(void *arg)
+{
+    size_t producer = (size_t)(uintptr_t)arg;
+    size_t seq = 0;
+
+    while (seq < RING_TEST_PER_PRODUCER) {
+        struct aesd_buffer_entry batch[3];
+        size_t n = 0;
+        while (n < 3 && seq + n < RING_TEST_PER_PRODUCER) {
+            batch[n] = make_entry(producer, seq + n);
+            n++;
+        }
+        n = aesd_mpsc_ring_push_batch(&mpsc_ring, batch, n);
+        if (n == 0) {
+            sched_yield();
+        }
+        seq += n;
+    }
+    return NULL;
+}
+
+void test_aesd_mpsc_ring_concurrent_producers()
+{
+    pthread_t thread[RING_TEST_PRODUCERS];
+    size_t next_seq[RING_TEST_PRODUCERS] = {0};
+    size_t received = 0;
+    bool in_order = true;
+    size_t i;
+
+    TEST_ASSERT_TRUE(aesd_mpsc_ring_init(&mpsc_ring, 64));
+    for (i = 0; i < RING_TEST_PRODUCERS; i++) {
+        TEST_ASSERT_EQUAL_INT(0, pthread_create(&thread[i], NULL, mpsc_producer, (void *)(uintptr_t)i));
+    }
+
+    while (received < RING_TEST_PRODUCERS * RING_TEST_PER_PRODUCER) {
+        struct aesd_buffer_entry entries[16];
+        size_t n = aesd_mpsc_ring_pop_batch(&mpsc_ring, entries, 16);
+        if (n == 0) {
+            sched_yield();
+        }
+        for (i = 0; i < n; i++) {
+            size_t producer = (size_t)(uintptr_t)entries[i].buffptr - 1;
+            if (producer >= RING_TEST_PRODUCERS || entries[i].size != next_seq[producer]) {
+                in_order = false;
+            } else {
+                next_seq[producer]++;
+            }
+        }
+        received += n;
+    }
+
+    for (i = 0; i < RING_TEST_PRODUCERS; i++) {
+        pthread_join(thread[i], NULL);
+    }
+    TEST_ASSERT_TRUE_MESSAGE(in_order, "Entries from each producer should be received once and in order");
+    struct aesd_buffer_entry out;
+    TEST_ASSERT_FALSE_MESSAGE(aesd_mpsc_ring_pop(&mpsc_ring, &out), "Ring should be empty once all entries are received");
+    aesd_mpsc_ring_destroy(&mpsc_ring);
+}
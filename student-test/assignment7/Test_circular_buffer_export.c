@@ -0,0 +1,121 @@
+#include "unity.h"
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include "../../aesd-char-driver/aesd-circular-buffer.h"
+
+/**
+ * Tests for the logical iteration and scatter-gather export API of the circular buffer,
+ * which the driver uses to copy ranges and userspace can pass straight to writev()
+ */
+
+static char entry_data[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED + 2][24];
+
+/**
+ * Add @param count entries to @param buffer containing "write1\n", "write2\n" ...
+ */
+static void fill_buffer(struct aesd_circular_buffer *buffer, int count)
+{
+    int i;
+    aesd_circular_buffer_init(buffer);
+    for (i = 0; i < count; i++) {
+        struct aesd_buffer_entry entry;
+        snprintf(entry_data[i], sizeof(entry_data[i]), "write%d\n", i + 1);
+        entry.buffptr = entry_data[i];
+        entry.size = strlen(entry_data[i]);
+        aesd_circular_buffer_add_entry(buffer, &entry);
+    }
+}
+
+/**
+ * Concatenate @param nvec members of @param vec into @param out
+ */
+static void join_vec(const struct iovec *vec, size_t nvec, char *out, size_t out_size)
+{
+    size_t i;
+    size_t len = 0;
+    for (i = 0; i < nvec; i++) {
+        TEST_ASSERT_TRUE_MESSAGE(len + vec[i].iov_len < out_size, "Exported range larger than expected");
+        memcpy(out + len, vec[i].iov_base, vec[i].iov_len);
+        len += vec[i].iov_len;
+    }
+    out[len] = '\0';
+}
+
+void test_circular_buffer_foreach_logical_order()
+{
+    struct aesd_circular_buffer buffer;
+    struct aesd_buffer_entry *entry;
+    uint8_t index;
+    int visited = 0;
+
+    fill_buffer(&buffer, 0);
+    AESD_CIRCULAR_BUFFER_FOREACH_LOGICAL(entry, &buffer, index) {
+        visited++;
+    }
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, visited, "Empty buffer should not iterate any entries");
+
+    fill_buffer(&buffer, AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED + 2);
+    TEST_ASSERT_EQUAL_INT(AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED, aesd_circular_buffer_count(&buffer));
+    AESD_CIRCULAR_BUFFER_FOREACH_LOGICAL(entry, &buffer, index) {
+        TEST_ASSERT_EQUAL_PTR_MESSAGE(entry_data[index + 2], entry->buffptr,
+                "Wrapped buffer should iterate from the oldest remaining entry");
+        visited++;
+    }
+    TEST_ASSERT_EQUAL_INT(AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED, visited);
+}
+
+void test_circular_buffer_export_range()
+{
+    struct aesd_circular_buffer buffer;
+    struct iovec vec[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+    char out[256];
+    size_t nvec;
+    size_t bytes;
+
+    fill_buffer(&buffer, 3);
+
+    bytes = aesd_circular_buffer_export_range(&buffer, 0, sizeof(out), vec, AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED, &nvec);
+    join_vec(vec, nvec, out, sizeof(out));
+    TEST_ASSERT_EQUAL_INT(3, nvec);
+    TEST_ASSERT_EQUAL_INT(21, bytes);
+    TEST_ASSERT_EQUAL_STRING("write1\nwrite2\nwrite3\n", out);
+
+    bytes = aesd_circular_buffer_export_range(&buffer, 4, 8, vec, AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED, &nvec);
+    join_vec(vec, nvec, out, sizeof(out));
+    TEST_ASSERT_EQUAL_INT(2, nvec);
+    TEST_ASSERT_EQUAL_INT(8, bytes);
+    TEST_ASSERT_EQUAL_STRING_MESSAGE("e1\nwrite", out, "Range should start and end within entries");
+
+    bytes = aesd_circular_buffer_export_range(&buffer, 14, 1, vec, AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED, &nvec);
+    join_vec(vec, nvec, out, sizeof(out));
+    TEST_ASSERT_EQUAL_INT(1, bytes);
+    TEST_ASSERT_EQUAL_STRING_MESSAGE("w", out, "Range starting on an entry boundary");
+
+    bytes = aesd_circular_buffer_export_range(&buffer, 21, 10, vec, AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED, &nvec);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, bytes, "Range past the end of the buffer should be empty");
+    TEST_ASSERT_EQUAL_INT(0, nvec);
+}
+
+void test_circular_buffer_export_range_wrapped()
+{
+    struct aesd_circular_buffer buffer;
+    struct iovec vec[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+    char out[256];
+    size_t nvec;
+    size_t bytes;
+
+    fill_buffer(&buffer, AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED + 2);
+
+    bytes = aesd_circular_buffer_export_range(&buffer, 0, sizeof(out), vec, AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED, &nvec);
+    join_vec(vec, nvec, out, sizeof(out));
+    TEST_ASSERT_EQUAL_INT(AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED, nvec);
+    TEST_ASSERT_EQUAL_STRING_MESSAGE(entry_data[2], vec[0].iov_base, "Export should start at the oldest entry");
+    TEST_ASSERT_EQUAL_INT(strlen(out), bytes);
+
+    bytes = aesd_circular_buffer_export_range(&buffer, 0, sizeof(out), vec, 2, &nvec);
+    join_vec(vec, nvec, out, sizeof(out));
+    TEST_ASSERT_EQUAL_INT_MESSAGE(2, nvec, "Export should stop when vec is full");
+    TEST_ASSERT_EQUAL_STRING("write3\nwrite4\n", out);
+    TEST_ASSERT_EQUAL_INT(14, bytes);
+}